@@ -8,7 +8,11 @@
  * see https://creativecommons.org/publicdomain/zero/1.0/
  */
 
-#define VERSION "20260402"
+#define VERSION "20261018"
+
+#ifdef __linux__
+ #define _GNU_SOURCE	/* struct ucred */
+#endif
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -18,6 +22,40 @@
 #include <signal.h>
 #include <setjmp.h>
 #include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <sys/wait.h>
+#include <spawn.h>
+#ifdef __linux__
+ #include <sys/epoll.h>
+ #include <sys/sendfile.h>
+ #include <sys/syscall.h>
+#endif
+#ifdef __SSE2__
+ #include <emmintrin.h>
+#endif
+
+/*
+ * The state of an interpreter instance (isolate) is kept in
+ * thread-local variables, so each thread may run its own
+ * isolate. Without __thread there is only one isolate.
+ */
+
+#ifdef __GNUC__
+ #include <pthread.h>
+ #include <time.h>
+ #define THREAD		__thread
+ #define ISOLATES
+#else
+ #define THREAD
+#endif
 
 /*
  * Tunable parameters
@@ -26,20 +64,46 @@
 #define IMAGEFILE	"ls9.image"
 #define IMAGESRC	"ls9.ls9"
 
-#define NNODES		262144
-#define NVCELLS		262144
+#ifndef NNODES
+ #define NNODES		262144
+#endif
+#ifndef NVCELLS
+ #define NVCELLS	262144
+#endif
 #define NPORTS		20
 #define TOKLEN		80
 #define CHUNKSIZE	1024
 #define MXMAX		2000
 #define NTRACE		10
 #define PRDEPTH		1024
+#define NROOTS		32
+#define NISOLATES	64
+#define NCHANNELS	1024
 
 /*
  * Basic data types
+ *
+ * Compile with -DCELL64 to get 64-bit cells on LP64 systems.
+ * Fixnums, node indices, and vector offsets are all cells, so
+ * this gives 64-bit fixnums and allows for pools of more than
+ * 2^31 cells (see NNODES and NVCELLS). Images created with
+ * one cell size cannot be loaded with the other one.
  */
 
-#define cell	int
+#ifdef CELL64
+ #define cell	long
+ #define ucell	unsigned long
+ #define CELL_MIN	LONG_MIN
+ #define CELL_MAX	LONG_MAX
+#else
+ #define cell	int
+ #define ucell	unsigned int
+ #define CELL_MIN	INT_MIN
+ #define CELL_MAX	INT_MAX
+#endif
+
+#define cellabs(x)	((x) < 0? -(x): (x))
+
 #define byte	unsigned char
 #define uint	unsigned int
 
@@ -59,14 +123,14 @@
  * Memory pools
  */
 
-cell	*Car = NULL,
-	*Cdr = NULL;
-byte	*Tag = NULL;
+THREAD cell	*Car = NULL,
+		*Cdr = NULL;
+THREAD byte	*Tag = NULL;
 
-cell	*Vectors = NULL;
+THREAD cell	*Vectors = NULL;
 
-cell	Freelist = NIL;
-cell	Freevec = 0;
+THREAD cell	Freelist = NIL;
+THREAD cell	Freevec = 0;
 
 #define ATOM_TAG	0x01	/* Atom, CAR = type, CDR = next */
 #define MARK_TAG	0x02	/* Mark */
@@ -125,6 +189,11 @@ cell	Freevec = 0;
 #define T_SYMBOL	(-18)
 #define T_VECTOR	(-19)
 #define T_FLOAT		(-20)
+#define T_SLICE		(-21)
+#define T_F64		(-22)
+#define T_S32		(-23)
+#define T_U8		(-24)
+#define T_COROUTINE	(-25)
 
 /*
  * Basic constructors 
@@ -161,6 +230,12 @@ cell	Freevec = 0;
 #define ctagp(n) \
 	(!specialp(n) && (tag(n) & ATOM_TAG) && T_CATCHTAG == car(n))
 
+#define ctag_co(n)	cadddr(cdr(n))
+#define ctag_level(n)	fixval(cadddr(cddr(n)))
+
+#define coroutinep(n) \
+	(!specialp(n) && (tag(n) & ATOM_TAG) && T_COROUTINE == car(n))
+
 #define eofp(n)	(EOFMARK == (n))
 
 #define fixp(n) \
@@ -198,6 +273,52 @@ cell	Freevec = 0;
 #define constp(n) \
 	(!specialp(n) && (tag(n) & CONST_TAG))
 
+/*
+ * Slices share the payload of a string or vector:
+ * (T_SLICE offset length . parent)
+ */
+
+#define slicep(n) \
+	(!specialp(n) && (tag(n) & ATOM_TAG) && T_SLICE == car(n))
+
+#define sliceoff(n)	(cadr(n))
+#define slicelen(n)	(caddr(n))
+#define sliceobj(n)	(cdddr(n))
+
+#define strslicep(n) \
+	(slicep(n) && T_STRING == car(sliceobj(n)))
+
+#define vecslicep(n) \
+	(slicep(n) && T_VECTOR == car(sliceobj(n)))
+
+#define anystrp(n)	(stringp(n) || strslicep(n))
+#define anyvecp(n)	(vectorp(n) || vecslicep(n))
+
+#define strdata(n) \
+	(slicep(n)? string(sliceobj(n)) + sliceoff(n): string(n))
+
+#define strsize(n) \
+	(slicep(n)? slicelen(n): stringlen(n)-1)
+
+#define vecdata(n) \
+	(slicep(n)? vector(sliceobj(n)) + sliceoff(n): vector(n))
+
+#define vecitems(n) \
+	(slicep(n)? slicelen(n): veclen(n))
+
+/*
+ * Typed arrays: unboxed f64, s32, or u8 elements
+ */
+
+#define arrayp(n) \
+	(!specialp(n) && (tag(n) & VECTOR_TAG) && \
+	 (T_F64 == car(n) || T_S32 == car(n) || T_U8 == car(n)))
+
+#define elsize(t) \
+	(T_F64 == (t)? sizeof(double): T_S32 == (t)? sizeof(int): 1)
+
+#define arrlen(n)	(stringlen(n) / elsize(car(n)))
+
 /*
  * Abstract machine opcodes
  */
@@ -234,7 +355,15 @@ enum {	OP_ILL, OP_APPLIS, OP_APPLIST, OP_APPLY, OP_TAILAPP, OP_QUOTE,
 
 	OP_ACOS, OP_ASIN, OP_ATAN, OP_ATAN2, OP_CEILING, OP_COS,
 	OP_EXP, OP_EXPT, OP_FIX2FLO, OP_FLO2FIX, OP_FLOATP, OP_FLOOR,
-	OP_LOG, OP_NUMBERP, OP_ROUND, OP_SIN, OP_SQRT, OP_TAN };
+	OP_LOG, OP_NUMBERP, OP_ROUND, OP_SIN, OP_SQRT, OP_TAN,
+
+	OP_GET_OUTSTR, OP_OPEN_OUTSTR, OP_SLICE, OP_SCOUNT, OP_SINDEX,
+	OP_SSEARCH, OP_SSEARCHCI, OP_ARRAYOP, OP_ASET, OP_READBLK,
+	OP_WRITEBLK, OP_READLN, OP_SSPLIT, OP_SFIELDS, OP_SETBUFMODE,
+	OP_PORTOP, OP_SERIALIZE, OP_DESERIALIZE, OP_COMPILE_FILE,
+	OP_DUMP_EXEC, OP_DUMP_DELTA, OP_ISOLATE, OP_ISOLATE_WAIT,
+	OP_COROUTINE, OP_RESUME, OP_YIELD, OP_COSTATE, OP_COEND,
+	OP_SPAWN, OP_MKCHANNEL, OP_CHANSEND, OP_CHANRECV, OP_CHANCLOSE };
 
 /*
  * I/O functions
@@ -252,8 +381,8 @@ int	set_outport(int port);
  * Error reporting and handling
  */
 
-int	Trace[NTRACE];
-int	Tp = 0;
+THREAD int	Trace[NTRACE];
+THREAD int	Tp = 0;
 
 void clrtrace(void) {
 	int	i;
@@ -269,14 +398,14 @@ int gottrace(void) {
 	return 0;
 }
 
-int	Plimit = 0;
+THREAD int	Plimit = 0;
 
-int	Line = 1;
-cell	Files = NIL;
+THREAD int	Line = 1;
+THREAD cell	Files = NIL;
 
-cell	Symbols;
+THREAD cell	Symbols;
 
-char	*ntoa(int x, int r);
+char	*ntoa(cell x, int r);
 
 void report(char *s, cell x) {
 	int	i, j, o;
@@ -314,27 +443,35 @@ void report(char *s, cell x) {
 	set_outport(o);
 }
 
-jmp_buf	Restart;
-jmp_buf	Errtag;
-cell	Handler = NIL;
+THREAD jmp_buf	Restart;
+THREAD jmp_buf	*Errtag = NULL;	/* innermost run() */
+THREAD cell	Handler = NIL;
+THREAD cell	Throwval = NIL;
+THREAD cell	Cur = NIL;	/* running coroutine */
 
-cell	Glob;
+THREAD cell	Glob;
 cell	S_errtag, S_errval;
 
 int	assq(cell x, cell a);
 void	bindset(cell v, cell a);
-cell	mkstr(char *s, int k);
+cell	mkstr(char *s, cell k);
+void	abort_format(void);
 
 void error(char *s, cell x) {
 	cell	n;
 
+	abort_format();
 	n = assq(S_errtag, Glob);
 	Handler = (NIL == n)? NIL: cadr(n);
+	if (ctagp(Handler) && ctag_co(Handler) != Cur)
+		Handler = NIL;
 	if (Handler != NIL) {
 		n = assq(S_errval, Glob);
 		if (n != NIL && cadr(n) == Handler)
 			bindset(S_errval, mkstr(s, strlen(s)));
-		longjmp(Errtag, 1);
+		n = assq(S_errval, Glob);
+		Throwval = NIL == n? NIL: cadr(n);
+		longjmp(*Errtag, 1);
 	}
 	report(s, x);
 	longjmp(Restart, 1);
@@ -357,84 +494,346 @@ void fatal(char *s) {
  * Low-level input/output
  */
 
-FILE	*Ports[NPORTS];
-char	Port_flags[NPORTS];
+/*
+ * File ports are file descriptors with buffers of their own.
+ * For input ports, Port_buf[p] holds the chars from Port_pos[p]
+ * up to (but not including) Port_lim[p] that have not yet been
+ * read. For output ports, it holds the first Port_lim[p] chars
+ * that have not yet been written. Port_size[p] is the size
+ * of the buffer.
+ *
+ * Output ports are fully buffered by default. Line-buffered
+ * ports are flushed after writing a newline and unbuffered
+ * ports after each write. The standard output port is line-
+ * buffered when connected to a terminal, the standard error
+ * port always is.
+ *
+ * Regular input files of at least PORTBUFSIZE chars are mapped
+ * into memory instead, so Port_buf[p] holds the entire file and
+ * the port never needs to be refilled.
+ *
+ * When a read from a non-blocking descriptor would block, PAGAIN
+ * is set and the input functions return NIL instead of EOF.
+ */
+
+#define PORTBUFSIZE	65536
 
-int	Inport = 0,
-	Outport = 1,
-	Errport = 2;
+#define PEOF_TAG	0x01	/* Port: EOF has been rejected */
+#define POUT_TAG	0x02	/* Port: output port */
+#define PMAP_TAG	0x04	/* Port: mapped file */
+#define PLINE_TAG	0x08	/* Port: line-buffered */
+#define PNOBUF_TAG	0x10	/* Port: unbuffered */
+#define PAGAIN_TAG	0x80	/* Port: input would have blocked */
+#define PSOCK_TAG	0x100	/* Port: output side of a socket */
+#define PPIPE_TAG	0x200	/* Port: output side of a process pipe */
+
+#define wouldblock() (EAGAIN == errno || EWOULDBLOCK == errno)
+
+THREAD int	*Port_fd = NULL;
+THREAD byte	**Port_buf = NULL;
+THREAD int	*Port_pos = NULL,
+		*Port_lim = NULL,
+		*Port_size = NULL;
+THREAD int	*Port_flags = NULL;
+
+/*
+ * String output ports have no file descriptor, but a string
+ * buffer in Port_str[] instead. The buffer doubles in size when
+ * full; Port_ptr[] holds the number of chars written so far.
+ */
+
+THREAD cell	*Port_str = NULL;
+THREAD cell	*Port_ptr = NULL;
+
+/*
+ * Ports that are being watched by the event loop have a
+ * callback in Port_cb[], all other ports have NIL.
+ */
+
+THREAD cell	*Port_cb = NULL;
+THREAD int	Nwatched = 0;
+
+/*
+ * The port table starts with NPORTS slots and doubles in size
+ * when all slots are in use. Unused slots are kept on the
+ * Port_free[] stack.
+ */
+
+THREAD int	Nports = 0;
+THREAD int	*Port_free = NULL;
+THREAD int	Nfree = 0;
+
+THREAD int	Inport = 0,
+		Outport = 1,
+		Errport = 2;
+
+THREAD char	*Instr = NULL;
+THREAD char	Rejected = -1;
+
+int	flushport(int p);
+
+int fillport(int p) {
+	int	k;
 
-cell	Outstr = NIL;
-int	Outmax = 0;
-int	Outptr = 0;
+	Port_flags[p] &= ~PAGAIN_TAG;
+	if (Port_flags[p] & PEOF_TAG) {
+		Port_flags[p] &= ~PEOF_TAG;
+		return EOF;
+	}
+	if (Port_fd[p] < 0)
+		fatal("fillport: input port is not open");
+	if (Port_flags[p] & PMAP_TAG)
+		return EOF;
+	if (0 == p) flushport(1);
+	k = read(Port_fd[p], Port_buf[p], Port_size[p]);
+	if (k < 0 && wouldblock())
+		Port_flags[p] |= PAGAIN_TAG;
+	if (k <= 0) {
+		Port_pos[p] = Port_lim[p] = 0;
+		return EOF;
+	}
+	Port_pos[p] = 1;
+	Port_lim[p] = k;
+	return Port_buf[p][0];
+}
+
+#define getport(p) \
+	(Port_pos[p] < Port_lim[p]? \
+		Port_buf[p][Port_pos[p]++]: \
+		fillport(p))
 
-char	*Instr = NULL;
-char	Rejected = -1;
+/*
+ * Mapped files are read-only, but the rejected char is always
+ * the one that has just been read, so it is already in place.
+ */
+
+void rejectport(int p, int c) {
+	if (EOF == c)
+		Port_flags[p] |= PEOF_TAG;
+	else if (Port_pos[p] > 0 && (Port_flags[p] & PMAP_TAG))
+		Port_pos[p]--;
+	else if (Port_pos[p] > 0)
+		Port_buf[p][--Port_pos[p]] = c;
+}
 
-int readc(void) {
+int readstrc(void) {
 	int	c;
 
-	if (Instr != NULL) {
-		if (Rejected > -1) {
-			c = Rejected;
-			Rejected = -1;
-			return c;
-		}
-		if (0 == *Instr) {
-			return EOF;
-		}
-		else {
-			return *Instr++;
-		}
+	if (Rejected > -1) {
+		c = Rejected;
+		Rejected = -1;
+		return c;
+	}
+	if (0 == *Instr) {
+		return EOF;
 	}
 	else {
-		if (NULL == Ports[Inport])
-			fatal("readc: input port is not open");
-		return getc(Ports[Inport]);
+		return *Instr++;
 	}
 }
 
+#define readc() \
+	(Instr != NULL? readstrc(): getport(Inport))
+
 void rejectc(int c) {
 	if (Instr != NULL) {
 		Rejected = c;
 	}
 	else {
-		ungetc(c, Ports[Inport]);
+		rejectport(Inport, c);
 	}
 }
 
 cell	mkport(int p, cell t);
+void	close_port(int port);
+
+/*
+ * All descriptors are close-on-exec, so processes started by
+ * OPEN-PROCESS do not inherit files and sockets of LISP9.
+ */
+
+#ifndef O_CLOEXEC
+ #define O_CLOEXEC	0
+#endif
+
+int cloexec(int fd) {
+	if (fd >= 0) fcntl(fd, F_SETFD, FD_CLOEXEC);
+	return fd;
+}
+
+/*
+ * Output to non-blocking descriptors waits until the descriptor
+ * becomes writable, so output functions never deliver partial
+ * results.
+ */
+
+int writeall(int fd, byte *s, cell k) {
+	cell		n;
+	struct pollfd	pf;
+
+	while (k > 0) {
+		n = write(fd, s, k);
+		if (n < 0 && EINTR == errno) continue;
+		if (n < 0 && wouldblock()) {
+			pf.fd = fd;
+			pf.events = POLLOUT;
+			poll(&pf, 1, -1);
+			continue;
+		}
+		if (n <= 0) return -1;
+		s += n;
+		k -= n;
+	}
+	return 0;
+}
+
+/*
+ * Writes to sockets and process pipes block SIGPIPE, so that
+ * a connection closed by the other end is reported as a write
+ * error instead of terminating LISP9. A SIGPIPE raised by the write is discarded.
+ * The disposition of SIGPIPE is never changed, so LISP9 in
+ * "ls9 prog | head" still exits quietly.
+ */
+
+#ifdef ISOLATES
+ #define setsigmask pthread_sigmask
+#else
+ #define setsigmask sigprocmask
+#endif
+
+#define quietport(p) (Port_flags[p] & (PSOCK_TAG | PPIPE_TAG))
+
+int blockpipe(sigset_t *old) {
+	sigset_t	set;
+	int		pend;
+
+	sigpending(&set);
+	pend = sigismember(&set, SIGPIPE);
+	sigemptyset(&set);
+	sigaddset(&set, SIGPIPE);
+	setsigmask(SIG_BLOCK, &set, old);
+	return pend;
+}
+
+void unblockpipe(sigset_t *old, int pend) {
+	sigset_t	set;
+	int		sig;
+
+	sigpending(&set);
+	if (!pend && sigismember(&set, SIGPIPE)) {
+		sigemptyset(&set);
+		sigaddset(&set, SIGPIPE);
+		sigwait(&set, &sig);
+	}
+	setsigmask(SIG_SETMASK, old, NULL);
+}
+
+int portwriteall(int p, byte *s, cell k) {
+	sigset_t	old;
+	int		r, pend;
+
+	if (!quietport(p)) return writeall(Port_fd[p], s, k);
+	pend = blockpipe(&old);
+	r = writeall(Port_fd[p], s, k);
+	unblockpipe(&old, pend);
+	return r;
+}
+
+int flushport(int p) {
+	int	k;
+
+	if (Port_fd[p] < 0 || !(Port_flags[p] & POUT_TAG))
+		return 0;
+	k = Port_lim[p];
+	Port_lim[p] = 0;
+	return portwriteall(p, Port_buf[p], k);
+}
+
+void flush_ports(void) {
+	int	i;
+
+	for (i=0; i<Nports; i++)
+		flushport(i);
+}
 
 void flush(void) {
-	if (fflush(Ports[Outport]))
+	if (flushport(Outport) < 0)
 		error("file write error, port",
 			mkport(Outport, T_OUTPORT));
 }
 
-void blockwrite(char *s, int k) {
-	cell	n;
+#define invecpool(s) \
+	((byte *) (s) >= (byte *) Vectors && \
+	 (byte *) (s) < (byte *) &Vectors[NVCELLS])
 
-	if (1 == Plimit) return;
-	if (Outstr != NIL) {
-		while (Outptr + k >= Outmax) {
-			n = mkstr(NULL, Outmax+1000);
-			memcpy(string(n), string(Outstr), Outptr);
-			Outmax += 1000;
-			Outstr = n;
-		}
-		memcpy(&string(Outstr)[Outptr], s, k);
-		Outptr += k;
-		string(Outstr)[Outptr] = 0;
+void strwrite(int p, char *s, cell k) {
+	cell	n, m, i;
+	char	*t;
+
+	i = Port_ptr[p];
+	m = stringlen(Port_str[p]) - 1;
+	if (i + k > m) {
+		/*
+		 * S may point into the vector pool, which
+		 * will be compacted by mkstr(), so copy it.
+		 */
+		t = NULL;
+		if (invecpool(s)) {
+			if ((t = malloc(k)) == NULL)
+				fatal("strwrite: out of physical memory");
+			memcpy(t, s, k);
+			s = t;
+		}
+		while (i + k > m) m *= 2;
+		n = mkstr(NULL, m);
+		memcpy(string(n), string(Port_str[p]), i);
+		Port_str[p] = n;
+		memcpy(&string(n)[i], s, k);
+		if (t != NULL) free(t);
+	}
+	else {
+		memcpy(&string(Port_str[p])[i], s, k);
+	}
+	Port_ptr[p] += k;
+}
+
+/*
+ * Blocks that do not fit in the buffer are written directly
+ * after flushing the buffer.
+ */
+
+int bufwrite(int p, char *s, cell k) {
+	if (Port_lim[p] + k > Port_size[p]) {
+		if (flushport(p) < 0) return -1;
+		if (k >= Port_size[p])
+			return portwriteall(p, (byte *) s, k);
+	}
+	memcpy(&Port_buf[p][Port_lim[p]], s, k);
+	Port_lim[p] += k;
+	return 0;
+}
+
+void writeport(int p, char *s, cell k) {
+	if (Port_str[p] != NIL) {
+		strwrite(p, s, k);
 		return;
 	}
-	if (NULL == Ports[Outport])
-		fatal("blockwrite: output port is not open");
-	if (fwrite(s, 1, k, Ports[Outport]) != k)
-		error("file write error, port",
-			mkport(Outport, T_OUTPORT));
-	if ((1 == Outport || 2 == Outport) && '\n' == s[k-1])
-		flush();
-	if (Plimit) {
+	if (Port_fd[p] < 0)
+		fatal("writeport: output port is not open");
+	if (bufwrite(p, s, k) < 0)
+		error("file write error, port", mkport(p, T_OUTPORT));
+	if ((	(Port_flags[p] & PNOBUF_TAG) ||
+		((Port_flags[p] & PLINE_TAG) && memchr(s, '\n', k))
+	    ) &&
+	    flushport(p) < 0
+	)
+		error("file write error, port", mkport(p, T_OUTPORT));
+}
+
+void blockwrite(char *s, cell k) {
+	if (1 == Plimit) return;
+	writeport(Outport, s, k);
+	if (Plimit && NIL == Port_str[Outport]) {
 		Plimit -= k;
 		if (Plimit < 1) Plimit = 1;
 	}
@@ -442,7 +841,15 @@ void blockwrite(char *s, int k) {
 
 void writec(int c) {
 	char	b[1];
+	int	p = Outport;
 
+	if (0 == Plimit && NIL == Port_str[p] && Port_buf[p] != NULL &&
+	    Port_lim[p] < Port_size[p] && !(Port_flags[p] & PNOBUF_TAG) &&
+	    (c != '\n' || !(Port_flags[p] & PLINE_TAG)))
+	{
+		Port_buf[p][Port_lim[p]++] = c;
+		return;
+	}
 	b[0] = c;
 	blockwrite(b, 1);
 }
@@ -455,22 +862,48 @@ void prints(char *s) {
  * Memory management
  */
 
+/*
+ * The pools are mapped anonymously, so that their pages will be
+ * zeroed on demand instead of being cleared in advance, and so
+ * that loadimg() can map image sections over them. Nodes above
+ * Freenode have never been used; cons3() takes them in order
+ * until the first collection puts them on the free list.
+ */
+
+THREAD cell	Freenode = 0;
+
+void *alloc_pool(long size) {
+	void	*p;
+
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return MAP_FAILED == p? NULL: p;
+}
+
 void alloc_nodepool(void) {
-	Car = malloc(sizeof(cell) * NNODES);
-	Cdr = malloc(sizeof(cell) * NNODES);
-	Tag = malloc(NNODES);
+	Car = alloc_pool(sizeof(cell) * NNODES);
+	Cdr = alloc_pool(sizeof(cell) * NNODES);
+	Tag = alloc_pool(NNODES);
 	if (NULL == Car || NULL == Cdr || NULL == Tag)
 		fatal("alloc_nodepool: out of physical memory");
-	memset(Car, 0, sizeof(cell) * NNODES);
-	memset(Cdr, 0, sizeof(cell) * NNODES);
-	memset(Tag, 0, NNODES);
+	Freelist = NIL;
+	Freenode = 0;
 }
 
 void alloc_vecpool(void) {
-	Vectors = malloc(sizeof(cell) * NVCELLS);
+	Vectors = alloc_pool(sizeof(cell) * NVCELLS);
 	if (NULL == Vectors)
 		fatal("alloc_vecpool: out of physical memory");
-	memset(Vectors, 0, sizeof(cell) * NVCELLS);
+	Freevec = 0;
+}
+
+void free_pools(void) {
+	munmap(Car, sizeof(cell) * NNODES);
+	munmap(Cdr, sizeof(cell) * NNODES);
+	munmap(Tag, NNODES);
+	munmap(Vectors, sizeof(cell) * NVCELLS);
+	Car = Cdr = Vectors = NULL;
+	Tag = NULL;
 }
 
 #define OBFREE		0
@@ -483,7 +916,21 @@ void alloc_vecpool(void) {
 
 #define fetcharg(a, i)	(((a)[i] << 8) | (a)[(i)+1])
 
-cell	Obarray, Obmap;
+THREAD cell	Obarray, Obmap;
+
+int opsize(int op) {
+	if (OP_QUOTE == op ||
+	    OP_ARG == op || OP_PUSHVAL == op || OP_JMP == op ||
+	    OP_BRF == op || OP_BRT == op || OP_CLOSURE == op ||
+	    OP_MKENV == op || OP_ENTER == op || OP_ENTCOL == op ||
+	    OP_SETARG == op || OP_SETREF == op || OP_MACRO == op)
+	{
+		return ISIZE1;
+	}
+	if (OP_REF == op || OP_CPARG == op || OP_CPREF == op)
+		return ISIZE2;
+	return ISIZE0;
+}
 
 void marklit(cell p) {
 	int	i, k, op;
@@ -492,25 +939,10 @@ void marklit(cell p) {
 	k = stringlen(p);
 	v = string(p);
 	m = string(Obmap);
-	for (i=0; i<k; ) {
+	for (i=0; i<k; i += opsize(op)) {
 		op = v[i];
-		if (OP_QUOTE == op) {
+		if (OP_QUOTE == op)
 			m[fetcharg(v, i+1)] = OBUSED;
-			i += ISIZE1;
-		}
-		else if (OP_ARG == op || OP_PUSHVAL == op || OP_JMP == op ||
-			 OP_BRF == op || OP_BRT == op || OP_CLOSURE == op ||
-			 OP_MKENV == op || OP_ENTER == op || OP_ENTCOL == op ||
-			 OP_SETARG == op || OP_SETREF == op || OP_MACRO == op)
-		{
-			i += ISIZE1;
-		}
-		else if (OP_REF == op || OP_CPARG == op || OP_CPREF == op) {
-			i += ISIZE2;
-		}
-		else {
-			i += ISIZE0;
-		}
 	}
 }
 
@@ -523,8 +955,7 @@ void marklit(cell p) {
  */
 
 void mark(cell n) {
-	cell	x, parent, *v;
-	int	i;
+	cell	x, parent, *v, i;
 
 	parent = NIL;
 	while (1) {
@@ -607,20 +1038,22 @@ void mark(cell n) {
 	}
 }
 
-int	GC_verbose = 0;
-cell	*GC_roots[];
-cell	Rts;
-int	Sp;
+THREAD int	GC_verbose = 0;
+THREAD cell	*GC_roots[NROOTS];
+THREAD cell	Rts;
+THREAD int	Sp;
 
-int gc(void) {
-	int	i, n, k, sk;
+cell gc(void) {
+	cell	i, n, k, sk;
 	char	buf[100];
 	cell	*a;
 	byte	*m;
 
-	for (i=0; i<NPORTS; i++) {
+	for (i=0; i<Nports; i++) {
 		if (Port_flags[i] & LOCK_TAG)
 			Port_flags[i] |= USED_TAG;
+		else if (Port_cb[i] != NIL)
+			Port_flags[i] |= USED_TAG;
 		else if (i == Inport || i == Outport)
 			Port_flags[i] |= USED_TAG;
 		else
@@ -636,6 +1069,12 @@ int gc(void) {
 	if (Rts != NIL) {
 		stringlen(Rts) = sk;
 	}
+	for (i=0; i<Nports; i++) {
+		if (Port_flags[i] & USED_TAG) {
+			mark(Port_str[i]);
+			mark(Port_cb[i]);
+		}
+	}
 	k = 0;
 	Freelist = NIL;
 	for (i=0; i<NNODES; i++) {
@@ -648,11 +1087,10 @@ int gc(void) {
 			tag(i) &= ~MARK_TAG;
 		}
 	}
-	for (i=0; i<NPORTS; i++) {
-		if (!(Port_flags[i] & USED_TAG) && Ports[i] != NULL) {
-			fclose(Ports[i]);
-			Ports[i] = NULL;
-		}
+	Freenode = NNODES;
+	for (i=0; i<Nports; i++) {
+		if (!(Port_flags[i] & USED_TAG))
+			close_port(i);
 	}
 	n = NIL == Obarray? 0: veclen(Obarray);
 	a = NIL == Obarray? NULL: vector(Obarray);
@@ -667,20 +1105,23 @@ int gc(void) {
 		}
 	}
 	if (GC_verbose) {
-		sprintf(buf, "GC: %d nodes reclaimed", k);
+		sprintf(buf, "GC: %ld nodes reclaimed", (long) k);
 		prints(buf); nl();
 		flush();
 	}
 	return k;
 }
 
-cell	Tmp_car = NIL,
-	Tmp_cdr = NIL;
+THREAD cell	Tmp_car = NIL,
+		Tmp_cdr = NIL;
 
 cell cons3(cell pcar, cell pcdr, int ptag) {
-	cell	n;
-	int	k;
+	cell	n, k;
 
+	if (NIL == Freelist && Freenode < NNODES) {
+		Freelist = Freenode++;
+		cdr(Freelist) = NIL;
+	}
 	if (NIL == Freelist) {
 		if (0 == (ptag & ~CONST_TAG))
 			Tmp_car = pcar;
@@ -707,7 +1148,7 @@ cell cons3(cell pcar, cell pcdr, int ptag) {
 #define RAW_VECDATA	2
 
 void unmark_vecs(void) {
-	int	p, k, link;
+	cell	p, k, link;
 
 	p = 0;
 	while (p < Freevec) {
@@ -718,8 +1159,8 @@ void unmark_vecs(void) {
 	}
 }
 
-int gcv(void) {
-	int	v, k, to, from;
+cell gcv(void) {
+	cell	v, k, to, from;
 	char	buf[100];
 
 	unmark_vecs();
@@ -741,7 +1182,7 @@ int gcv(void) {
 	}
 	k = Freevec - to;
 	if (GC_verbose) {
-		sprintf(buf, "GCV: %d cells reclaimed", k);
+		sprintf(buf, "GCV: %ld cells reclaimed", (long) k);
 		prints(buf); nl();
 		flush();
 	}
@@ -749,9 +1190,8 @@ int gcv(void) {
 	return k;
 }
 
-cell newvec(cell type, int size) {
-	cell	n;
-	int	v, wsize;
+cell newvec(cell type, cell size) {
+	cell	n, v, wsize;
 
 	wsize = vecsize(size);
 	if (Freevec + wsize >= NVCELLS) {
@@ -767,8 +1207,8 @@ cell newvec(cell type, int size) {
 	return n;
 }
 
-cell	Protected = NIL;
-cell	Tmp = NIL;
+THREAD cell	Protected = NIL;
+THREAD cell	Tmp = NIL;
 
 #define protect(n) (Protected = cons((n), Protected))
 
@@ -794,12 +1234,12 @@ cell unprot(int k) {
 #define fixval(n) (cadr(n))
 
 #define add_ovfl(a,b) \
-	((((b) > 0) && ((a) > INT_MAX - (b))) || \
-	 (((b) < 0) && ((a) < INT_MIN - (b))))
+	((((b) > 0) && ((a) > CELL_MAX - (b))) || \
+	 (((b) < 0) && ((a) < CELL_MIN - (b))))
 
 #define sub_ovfl(a,b) \
-	((((b) < 0) && ((a) > INT_MAX + (b))) || \
-	 (((b) > 0) && ((a) < INT_MIN + (b))))
+	((((b) < 0) && ((a) > CELL_MAX + (b))) || \
+	 (((b) > 0) && ((a) < CELL_MIN + (b))))
 
 cell mkfloat(double d) {
 	cell	n;
@@ -827,7 +1267,7 @@ double numval(cell n) {
 
 cell	Nullstr = NIL;
 
-cell mkstr(char *s, int k) {
+cell mkstr(char *s, cell k) {
 	cell	n;
 
 	if (0 == k) return Nullstr;
@@ -844,9 +1284,9 @@ cell mkstr(char *s, int k) {
 
 cell	Nullvec = NIL;
 
-cell mkvec(int k) {
+cell mkvec(cell k) {
 	cell	n, *v;
-	int	i;
+	cell	i;
 
 	if (0 == k) return Nullvec;
 	n = newvec(T_VECTOR, k * sizeof(cell));
@@ -855,6 +1295,36 @@ cell mkvec(int k) {
 	return n;
 }
 
+cell mkslice(cell x, cell off, cell len) {
+	cell	n;
+
+	if (slicep(x)) {
+		off += sliceoff(x);
+		x = sliceobj(x);
+	}
+	n = mkatom(len, x);
+	n = mkatom(off, n);
+	return mkatom(T_SLICE, n);
+}
+
+/*
+ * Copy the content of a string slice to a fresh string,
+ * so it can be passed to functions expecting a C string.
+ */
+
+cell unslice(cell x) {
+	cell	n;
+	int	k;
+
+	if (!strslicep(x)) return x;
+	k = slicelen(x);
+	protect(x);
+	n = mkstr(NULL, k);
+	memcpy(string(n), strdata(x), k);
+	unprot(1);
+	return n;
+}
+
 cell mkport(int portno, cell type) {
 	cell	n;
 	int	pf;
@@ -893,29 +1363,41 @@ cell mkht(int k) {
 #define htdata(d)	cdr(d)
 #define htslots(d)	vector(cdr(d))
 
-uint hash(byte *s, uint k) {
-	uint	h = 0xabcd;
+/*
+ * Hash four bytes per step. The bytes are combined explicitly,
+ * so hash values do not depend on alignment or byte order.
+ */
+
+uint hash(byte *s, cell n, uint k) {
+	uint	h = 0xabcd, w;
 
-	while (*s) h = ((h << 5) + h) ^ *s++;
+	while (n >= 4) {
+		w = s[0] | s[1] << 8 | s[2] << 16 | (uint) s[3] << 24;
+		h = (h ^ w) * 0x9e3779b1;
+		s += 4;
+		n -= 4;
+	}
+	while (n--) h = (h ^ *s++) * 0x9e3779b1;
+	h ^= h >> 16;
 	return h % k;
 }
 
 uint obhash(cell x, uint k) {
 	if (specialp(x))
-		return abs(x) % k;
+		return (uint) -x % k;
 	if (symbolp(x))
-		return hash(symname(x), k);
+		return hash(symname(x), symlen(x)-1, k);
 	if (fixp(x))
-		return abs(fixval(x)) % k;
+		return (uint) cellabs(fixval(x)) % k;
 	if (charp(x))
 		return charval(x) % k;
-	if (stringp(x))
-		return hash(string(x), k);
+	if (anystrp(x))
+		return hash(strdata(x), strsize(x), k);
 	return 0;
 }
 
 int match(cell a, cell b) {
-	int	k;
+	cell	k;
 
 	if (a == b) {
 		return 1;
@@ -931,10 +1413,10 @@ int match(cell a, cell b) {
 		if (symlen(b) != k) return 0;
 		return memcmp(symname(a), symname(b), k) == 0;
 	}
-	if (stringp(a) && stringp(b)) {
-		k = stringlen(a);
-		if (stringlen(b) != k) return 0;
-		return memcmp(string(a), string(b), k) == 0;
+	if (anystrp(a) && anystrp(b)) {
+		k = strsize(a);
+		if (strsize(b) != k) return 0;
+		return memcmp(strdata(a), strdata(b), k) == 0;
 	}
 	return 0;
 }
@@ -1008,11 +1490,11 @@ cell htrem(cell d, cell k) {
 	return d;
 }
 
-cell	Symhash = NIL;
-cell	Symbols = NIL;
-int	Symptr = 0;
+THREAD cell	Symhash = NIL;
+THREAD cell	Symbols = NIL;
+THREAD cell	Symptr = 0;
 
-cell mksym(char *s, int k) {
+cell mksym(char *s, cell k) {
 	cell	n;
 
 	n = newvec(T_SYMBOL, k+1);
@@ -1116,39 +1598,114 @@ cell nconc(cell a, cell b) {
  * High-level port I/O
  */
 
-int newport(void) {
-	int	i, n;
+void *portmem(void *p, int k) {
+	if ((p = realloc(p, k)) == NULL)
+		fatal("grow_ports: out of physical memory");
+	return p;
+}
 
-	for (n=0; n<2; n++) {
-		for (i=0; i<NPORTS; i++) {
-			if (NULL == Ports[i])
-				return i;
-		}
-		if (0 == n) gc();
-	}
-	return -1;
+void grow_ports(void) {
+	int	i, k;
+
+	k = Nports? Nports * 2: NPORTS;
+	Port_fd = portmem(Port_fd, k * sizeof(int));
+	Port_buf = portmem(Port_buf, k * sizeof(byte *));
+	Port_pos = portmem(Port_pos, k * sizeof(int));
+	Port_lim = portmem(Port_lim, k * sizeof(int));
+	Port_size = portmem(Port_size, k * sizeof(int));
+	Port_flags = portmem(Port_flags, k * sizeof(int));
+	Port_str = portmem(Port_str, k * sizeof(cell));
+	Port_cb = portmem(Port_cb, k * sizeof(cell));
+	Port_ptr = portmem(Port_ptr, k * sizeof(cell));
+	Port_free = portmem(Port_free, k * sizeof(int));
+	for (i = k-1; i >= Nports; i--) {
+		Port_fd[i] = -1;
+		Port_buf[i] = NULL;
+		Port_pos[i] = Port_lim[i] = 0;
+		Port_flags[i] = 0;
+		Port_str[i] = NIL;
+		Port_cb[i] = NIL;
+		Port_free[Nfree++] = i;
+	}
+	Nports = k;
 }
 
-int open_inport(char *path) {
+int newport(void) {
+	if (0 == Nfree) grow_ports();
+	return Port_free[--Nfree];
+}
+
+#define freeport(p) (Port_free[Nfree++] = (p))
+
+int open_fdport(int fd, int flags) {
 	int	i;
 
+	if (fd < 0) return -1;
 	i = newport();
-	if (i < 0) return -1;
-	Ports[i] = fopen(path, "r");
-	if (NULL == Ports[i]) return -1;
+	if ((Port_buf[i] = malloc(PORTBUFSIZE)) == NULL) {
+		freeport(i);
+		close(fd);
+		return -1;
+	}
+	Port_fd[i] = fd;
+	Port_pos[i] = Port_lim[i] = 0;
+	Port_size[i] = PORTBUFSIZE;
+	Port_flags[i] = flags;
 	return i;
 }
 
+int open_inport(char *path) {
+	int		fd, p;
+	struct stat	st;
+	void		*m;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return -1;
+	if (	fstat(fd, &st) < 0 ||
+		!S_ISREG(st.st_mode) ||
+		st.st_size < PORTBUFSIZE ||
+		st.st_size > INT_MAX
+	)
+		return open_fdport(fd, 0);
+	m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (MAP_FAILED == m)
+		return open_fdport(fd, 0);
+	p = newport();
+	madvise(m, st.st_size, MADV_SEQUENTIAL);
+	Port_fd[p] = fd;
+	Port_buf[p] = m;
+	Port_pos[p] = 0;
+	Port_lim[p] = Port_size[p] = st.st_size;
+	Port_flags[p] = PMAP_TAG;
+	return p;
+}
+
 int open_outport(char *path, int append) {
+	int	fd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC |
+		(append? O_APPEND: O_TRUNC),
+		0666);
+	return open_fdport(fd, POUT_TAG);
+}
+
+#define STRBUFSIZE	64
+
+int open_strport(void) {
 	int	i;
+	cell	n;
 
 	i = newport();
 	if (i < 0) return -1;
-	Ports[i] = fopen(path, append? "a": "w");
-	if (NULL == Ports[i]) return -1;
+	n = mkstr(NULL, STRBUFSIZE);
+	Port_str[i] = n;
+	Port_ptr[i] = 0;
 	return i;
 }
 
+#define strportp(p) \
+	(outportp(p) && Port_str[portno(p)] != NIL)
+
 cell set_inport(cell port) {
 	cell	p = Inport;
 
@@ -1163,36 +1720,90 @@ int set_outport(int port) {
 	return p;
 }
 
+/*
+ * On Linux, watched ports are registered with an epoll instance.
+ * Elsewhere, they are polled with poll() in wait_events().
+ */
+
+#ifdef __linux__
+THREAD int	Epfd = -1;
+#endif
+
+int watch_port(int p, cell f) {
+#ifdef __linux__
+	struct epoll_event	ev;
+
+	if (NIL == Port_cb[p]) {
+		if (Epfd < 0 && (Epfd = epoll_create(16)) < 0)
+			return -1;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = Port_flags[p] & POUT_TAG? EPOLLOUT: EPOLLIN;
+		ev.data.fd = p;
+		if (epoll_ctl(Epfd, EPOLL_CTL_ADD, Port_fd[p], &ev) < 0)
+			return -1;
+	}
+#endif
+	if (NIL == Port_cb[p]) Nwatched++;
+	Port_cb[p] = f;
+	return 0;
+}
+
+void unwatch_port(int p) {
+	if (NIL == Port_cb[p])
+		return;
+#ifdef __linux__
+	epoll_ctl(Epfd, EPOLL_CTL_DEL, Port_fd[p], NULL);
+#endif
+	Port_cb[p] = NIL;
+	Nwatched--;
+}
+
+/*
+ * Free slots have neither a descriptor nor a string buffer,
+ * so they are not released again.
+ */
+
 void close_port(int port) {
-	if (port < 0 || port >= NPORTS)
+	if (port < 0 || port >= Nports)
 		return;
-	if (NULL == Ports[port]) {
+	if (Port_fd[port] < 0 && NIL == Port_str[port])
+		return;
+	unwatch_port(port);
+	freeport(port);
+	Port_str[port] = NIL;
+	if (Port_fd[port] < 0) {
 		Port_flags[port] = 0;
 		return;
 	}
-	fclose(Ports[port]);
-	Ports[port] = NULL;
+	flushport(port);
+	if (Port_flags[port] & PSOCK_TAG)
+		shutdown(Port_fd[port], SHUT_WR);
+	close(Port_fd[port]);
+	if (Port_flags[port] & PMAP_TAG)
+		munmap(Port_buf[port], Port_lim[port]);
+	else
+		free(Port_buf[port]);
+	Port_fd[port] = -1;
+	Port_buf[port] = NULL;
 	Port_flags[port] = 0;
 }
 
 void reset_stdports(void) {
-	clearerr(stdin);
-	clearerr(stdout);
-	clearerr(stderr);
+	Port_flags[0] &= ~PEOF_TAG;
 	Inport = 0;
 	Outport = 1;
 	Errport = 2;
 }
 
 int lock_port(int port) {
-	if (port < 0 || port >= NPORTS)
+	if (port < 0 || port >= Nports)
 		return -1;
 	Port_flags[port] |= LOCK_TAG;
 	return 0;
 }
 
 int unlock_port(int port) {
-	if (port < 0 || port >= NPORTS)
+	if (port < 0 || port >= Nports)
 		return -1;
 	Port_flags[port] &= ~LOCK_TAG;
 	return 0;
@@ -1202,7 +1813,7 @@ int unlock_port(int port) {
  * Global environment
  */
 
-cell	Glob = NIL;
+THREAD cell	Glob = NIL;
 
 void bindnew(cell v, cell a) {
 	cell	n;
@@ -1231,8 +1842,9 @@ void bindset(cell v, cell a) {
 
 cell	S_apply, S_def, S_defmac, S_defun, S_errtag,
 	S_errval, S_if, S_ifstar, S_imagefile, S_labels, S_lambda,
-	S_macro, S_prog, S_quiet, S_quote, S_qquote, S_starstar,
-	S_splice, S_setq, S_start, S_unquote;
+	S_macro, S_prog, S_program, S_quiet, S_quote, S_qquote,
+	S_starstar, S_splice, S_setq, S_start, S_unquote, S_unwind,
+	S_dead, S_running, S_suspended, S_waiting;
 
 cell	P_abs, P_alphac, P_atom, P_bitop, P_caar, P_cadr, P_car,
 	P_catchstar, P_cdar, P_cddr, P_cdr, P_cequal, P_cgrtr, P_cgteq,
@@ -1259,10 +1871,19 @@ cell	P_acos, P_asin, P_atan, P_atan2, P_ceiling, P_cos,
 	P_exp, P_expt, P_fix2flo, P_flo2fix, P_floatp, P_floor,
 	P_log, P_numberp, P_round, P_sin, P_sqrt, P_tan;
 
-volatile int	Intr;
+cell	P_get_outstr, P_open_outstr, P_slice, P_scount, P_sindex,
+	P_ssearch, P_ssearchci, P_arrayop, P_aset, P_readblk,
+	P_writeblk, P_readln, P_readline, P_ssplit, P_sfields,
+	P_setbufmode, P_portop, P_serialize, P_deserialize,
+	P_compile_file, P_dump_exec, P_dump_delta, P_isolate,
+	P_isolate_wait, P_coroutinestar, P_resumestar, P_yieldstar,
+	P_costate, P_spawn, P_mkchannel, P_chansend, P_chanrecv,
+	P_chanclose;
 
-int	Inlist = 0;
-int	Quoting = 0;
+THREAD volatile int	Intr;
+
+THREAD int	Inlist = 0;
+THREAD int	Quoting = 0;
 
 #define octalp(c) \
 	('0' == (c) || '1' == (c) || '2' == (c) || '3' == (c) || \
@@ -1297,7 +1918,7 @@ int strcmp_ci(char *s1, char *s2) {
 	return c1-c2;
 }
 
-char	*Readerr = NULL;
+THREAD char	*Readerr = NULL;
 
 void rderror(char *s, cell x) {
 	if (NULL == Instr) error(s, x);
@@ -1407,7 +2028,8 @@ int pos(int p, char *s) {
 }
 
 cell scanfix(char *s, int r, int of) {
-	int	v, g, i;
+	cell	v;
+	int	g, i;
 	char	*p;
 	char	d[] = "0123456789abcdefghijklmnopqrstuvwxyz";
 
@@ -1424,7 +2046,7 @@ cell scanfix(char *s, int r, int of) {
 	while (*p) {
 		i = pos(tolower(*p), d);
 		if (i < 0 || i >= r) return NIL;
-		if (	v > INT_MAX/r ||
+		if (	v > CELL_MAX/r ||
 			(v > 0 && add_ovfl(v*r, i)) ||
 			(v < 0 && sub_ovfl(v*r, i)))
 		{
@@ -1569,7 +2191,8 @@ cell meta(void) {
 	cell	n, cmdsym;
 	char	s[128];
 
-	cmd = tolower(readc());
+	c = readc();
+	cmd = tolower(c);
 	c = readc();
 	while (' ' == c) c = readc();
 	i = 0;
@@ -1673,8 +2296,8 @@ cell xread(void) {
  * Printer
  */
 
-char *ntoa(int x, int r) {
-	static char	buf[200];
+char *ntoa(cell x, int r) {
+	static THREAD char	buf[200];
 	int		i = 0, neg;
 	char		*p = &buf[sizeof(buf)-1];
 	char		d[] = "0123456789abcdefghijklmnopqrstuvwxyz";
@@ -1684,7 +2307,7 @@ char *ntoa(int x, int r) {
 	while (x || 0 == i) {
 		i++;
 		p--;
-		*p = d[abs(x % r)];
+		*p = d[cellabs(x % r)];
 		x = x / r;
 	}
 	if (neg) {
@@ -1715,22 +2338,28 @@ void prfix(cell x) {
 	prints(ntoa(fixval(x), 10));
 }
 
-void prfloat(cell x) {
+void prdouble(double d) {
 	char	buf[40];
 
-	sprintf(buf, "%.15g", floatval(x));
+	sprintf(buf, "%.15g", d);
 	if (!strchr(buf, '.') && !strchr(buf, 'e') && !strchr(buf, 'E'))
 		strcat(buf, ".0");
 	prints(buf);
 }
 
+void prfloat(cell x) {
+	prdouble(floatval(x));
+}
+
 void prstr(int sl, cell x) {
-	int	i, c;
+	cell	i, k;
+	int	c;
 
+	k = strsize(x);
 	if (sl) {
 		writec('"');
-		for (i=0; i<stringlen(x)-1; i++) {
-			c = (byte) string(x)[i];
+		for (i=0; i<k; i++) {
+			c = strdata(x)[i];
 			if ('"' == c)
 				prints("\\\"");
 			else if ('\\' == c)
@@ -1739,7 +2368,7 @@ void prstr(int sl, cell x) {
 				prints("\\n");
 			else if (c < ' ' || c > 126) {
 				writec('\\');
-				if (octalp(string(x)[i+1])) {
+				if (i+1 < k && octalp(strdata(x)[i+1])) {
 					if (c < 100) writec('0');
 					if (c < 10) writec('0');
 				}
@@ -1751,7 +2380,7 @@ void prstr(int sl, cell x) {
 		writec('"');
 	}
 	else {
-		printb(string(x));
+		blockwrite((char *) strdata(x), k);
 	}
 }
 
@@ -1774,13 +2403,34 @@ void prlist(int sl, cell x, int d) {
 	writec(RP);
 }
 
+double	getf64(byte *p, cell i);
+
+void prarray(cell x) {
+	cell	i, k;
+
+	prints(T_F64 == car(x)? "#<f64vector":
+		T_S32 == car(x)? "#<s32vector": "#<u8vector");
+	k = arrlen(x);
+	for (i=0; i<k; i++) {
+		writec(' ');
+		if (T_F64 == car(x))
+			prdouble(getf64(string(x), i));
+		else if (T_S32 == car(x))
+			prints(ntoa(((int *) string(x))[i], 10));
+		else
+			prints(ntoa(string(x)[i], 10));
+	}
+	writec('>');
+}
+
 void prvec(int sl, cell x, int d) {
-	int	i;
+	int	i, k;
 
 	prints("#(");
-	for (i=0; i<veclen(x); i++) {
-		prex(sl, vector(x)[i], d+1);
-		if (i < veclen(x)-1) writec(' ');
+	k = vecitems(x);
+	for (i=0; i<k; i++) {
+		prex(sl, vecdata(x)[i], d+1);
+		if (i < k-1) writec(' ');
 	}
 	writec(')');
 }
@@ -1833,10 +2483,12 @@ void prex(int sl, cell x, int d) {
 	else if (fixp(x)) prfix(x);
 	else if (floatp(x)) prfloat(x);
 	else if (symbolp(x)) printb(symname(x));
-	else if (stringp(x)) prstr(sl, x);
-	else if (vectorp(x)) prvec(sl, x, d);
+	else if (anystrp(x)) prstr(sl, x);
+	else if (anyvecp(x)) prvec(sl, x, d);
+	else if (arrayp(x)) prarray(x);
 	else if (closurep(x)) prints("#<function>");
 	else if (ctagp(x)) prints("#<catch tag>");
+	else if (coroutinep(x)) prints("#<coroutine>");
 	else if (inportp(x)) prport(0, x);
 	else if (outportp(x)) prport(1, x);
 	else if (specialp(x)) pruspec(x);
@@ -2146,9 +2798,9 @@ cell lastpair(cell x) {
 	return x;
 }
 
-cell	Env = NIL,
-	Envp = NIL,
-	Defined = NIL;
+THREAD cell	Env = NIL,
+		Envp = NIL,
+		Defined = NIL;
 
 void newvar(cell x) {
 	cell	n;
@@ -2406,10 +3058,10 @@ cell clsconv(cell x) {
  * Compiler, literal pool
  */
 
-cell	Obhash = NIL,
-	Obarray = NIL,
-	Obmap = NIL;
-int	Obptr = 0;
+THREAD cell	Obhash = NIL,
+		Obarray = NIL,
+		Obmap = NIL;
+THREAD int	Obptr = 0;
 
 int obslot(void) {
 	int	i, j, k, m;
@@ -2467,8 +3119,8 @@ int obindex(cell x) {
  * Compiler, code generator
  */
 
-cell	Emitbuf = NIL;
-int	Here = 0;
+THREAD cell	Emitbuf = NIL;
+THREAD int	Here = 0;
 
 void emit(int x) {
 	cell	n;
@@ -2514,7 +3166,7 @@ void patch(int a, int n) {
 	string(cdr(Emitbuf))[a+1] = n & 255;
 }
 
-cell	Cts = NIL;
+THREAD cell	Cts = NIL;
 
 #define cpushval(x) (Cts = cons(mkfix(x), Cts))
 
@@ -2545,6 +3197,7 @@ int subr0(cell x) {
 	if (x == P_gensym)	return OP_GENSYM;
 	if (x == P_inport)	return OP_INPORT;
 	if (x == P_obtab)	return OP_OBTAB;
+	if (x == P_open_outstr)	return OP_OPEN_OUTSTR;
 	if (x == P_outport)	return OP_OUTPORT;
 	if (x == P_quit)	return OP_QUIT;
 	if (x == P_symtab)	return OP_SYMTAB;
@@ -2570,13 +3223,18 @@ int subr1(cell x) {
 	if (x == P_char)	return OP_CHAR;
 	if (x == P_charp)	return OP_CHARP;
 	if (x == P_charval)	return OP_CHARVAL;
+	if (x == P_chanclose)	return OP_CHANCLOSE;
+	if (x == P_chanrecv)	return OP_CHANRECV;
 	if (x == P_close_port)	return OP_CLOSE_PORT;
+	if (x == P_compile_file) return OP_COMPILE_FILE;
 	if (x == P_constp)	return OP_CONSTP;
+	if (x == P_coroutinestar) return OP_COROUTINE;
+	if (x == P_costate)	return OP_COSTATE;
 	if (x == P_ctagp)	return OP_CTAGP;
 	if (x == P_delete)	return OP_DELETE;
-	if (x == P_dump_image)	return OP_DUMP_IMAGE;
+	if (x == P_deserialize)	return OP_DESERIALIZE;
 	if (x == P_downcase)	return OP_DOWNCASE;
-	if (x == P_dump_image)	return OP_DUMP_IMAGE;
+	if (x == P_dump_delta)	return OP_DUMP_DELTA;
 	if (x == P_eofp)	return OP_EOFP;
 	if (x == P_eval)	return OP_EVAL;
 	if (x == P_existsp)	return OP_EXISTSP;
@@ -2589,12 +3247,16 @@ int subr1(cell x) {
 	if (x == P_flush)	return OP_FLUSH;
 	if (x == P_format)	return OP_FORMAT;
 	if (x == P_funp)	return OP_FUNP;
+	if (x == P_get_outstr)	return OP_GET_OUTSTR;
 	if (x == P_inportp)	return OP_INPORTP;
+	if (x == P_isolate)	return OP_ISOLATE;
+	if (x == P_isolate_wait) return OP_ISOLATE_WAIT;
 	if (x == P_liststr)	return OP_LISTSTR;
 	if (x == P_listvec)	return OP_LISTVEC;
 	if (x == P_load)	return OP_LOAD;
 	if (x == P_log)		return OP_LOG;
 	if (x == P_lowerc)	return OP_LOWERC;
+	if (x == P_mkchannel)	return OP_MKCHANNEL;
 	if (x == P_mx)		return OP_MX;
 	if (x == P_mx1)		return OP_MX1;
 	if (x == P_not)		return OP_NULL;
@@ -2608,6 +3270,7 @@ int subr1(cell x) {
 	if (x == P_pair)	return OP_PAIR;
 	if (x == P_set_inport)	return OP_SET_INPORT;
 	if (x == P_set_outport) return OP_SET_OUTPORT;
+	if (x == P_spawn)	return OP_SPAWN;
 	if (x == P_ssize)	return OP_SSIZE;
 	if (x == P_sqrt)	return OP_SQRT;
 	if (x == P_stringp)	return OP_STRINGP;
@@ -2624,11 +3287,13 @@ int subr1(cell x) {
 	if (x == P_vectorp)	return OP_VECTORP;
 	if (x == P_vsize)	return OP_VSIZE;
 	if (x == P_whitec)	return OP_WHITEC;
+	if (x == P_yieldstar)	return OP_YIELD;
 	return -1;
 }
 
 int subr2(cell x) {
 	if (x == P_atan2)	return OP_ATAN2;
+	if (x == P_chansend)	return OP_CHANSEND;
 	if (x == P_cons)	return OP_CONS;
 	if (x == P_div)		return OP_DIV;
 	if (x == P_expt)	return OP_EXPT;
@@ -2637,11 +3302,13 @@ int subr2(cell x) {
 	if (x == P_reconc)	return OP_RECONC;
 	if (x == P_rem)		return OP_REM;
 	if (x == P_rename)	return OP_RENAME;
+	if (x == P_resumestar)	return OP_RESUME;
 	if (x == P_sless)	return OP_SLESS;
 	if (x == P_slteq)	return OP_SLTEQ;
 	if (x == P_sequal)	return OP_SEQUAL;
 	if (x == P_sgrtr)	return OP_SGRTR;
 	if (x == P_sgteq)	return OP_SGTEQ;
+	if (x == P_setbufmode)	return OP_SETBUFMODE;
 	if (x == P_setcar)	return OP_SETCAR;
 	if (x == P_setcdr)	return OP_SETCDR;
 	if (x == P_sfill)	return OP_SFILL;
@@ -2650,7 +3317,13 @@ int subr2(cell x) {
 	if (x == P_siequal)	return OP_SIEQUAL;
 	if (x == P_sigrtr)	return OP_SIGRTR;
 	if (x == P_sigteq)	return OP_SIGTEQ;
+	if (x == P_scount)	return OP_SCOUNT;
+	if (x == P_sfields)	return OP_SFIELDS;
+	if (x == P_sindex)	return OP_SINDEX;
 	if (x == P_sref)	return OP_SREF;
+	if (x == P_ssplit)	return OP_SSPLIT;
+	if (x == P_ssearch)	return OP_SSEARCH;
+	if (x == P_ssearchci)	return OP_SSEARCHCI;
 	if (x == P_throwstar)	return OP_THROWSTAR;
 	if (x == P_vfill)	return OP_VFILL;
 	if (x == P_vref)	return OP_VREF;
@@ -2658,6 +3331,10 @@ int subr2(cell x) {
 }
 
 int subr3(cell x) {
+	if (x == P_arrayop)	return OP_ARRAYOP;
+	if (x == P_aset)	return OP_ASET;
+	if (x == P_portop)	return OP_PORTOP;
+	if (x == P_slice)	return OP_SLICE;
 	if (x == P_sset)	return OP_SSET;
 	if (x == P_substr)	return OP_SUBSTR;
 	if (x == P_subvec)	return OP_SUBVEC;
@@ -2669,10 +3346,14 @@ int osubr0(cell x) {
 	if (x == P_peekc)	return OP_PEEKC;
 	if (x == P_read)	return OP_READ;
 	if (x == P_readc)	return OP_READC;
+	if (x == P_readln)	return OP_READLN;
+	if (x == P_readline)	return OP_READLN;
 	return -1;
 }
 
 int osubr1(cell x) {
+	if (x == P_dump_exec)		return OP_DUMP_EXEC;
+	if (x == P_dump_image)		return OP_DUMP_IMAGE;
 	if (x == P_error)		return OP_ERROR;
 	if (x == P_mkstr)		return OP_MKSTR;
 	if (x == P_mkvec)		return OP_MKVEC;
@@ -2680,7 +3361,10 @@ int osubr1(cell x) {
 	if (x == P_open_outfile)	return OP_OPEN_OUTFILE;
 	if (x == P_prin)		return OP_PRIN;
 	if (x == P_princ)		return OP_PRINC;
+	if (x == P_readblk)		return OP_READBLK;
+	if (x == P_serialize)		return OP_SERIALIZE;
 	if (x == P_strnum)		return OP_STRNUM;
+	if (x == P_writeblk)		return OP_WRITEBLK;
 	if (x == P_writec)		return OP_WRITEC;
 	return -1;
 }
@@ -2916,18 +3600,24 @@ void composubr1(cell x, int op) {
 		else if (OP_MKVEC == op) {
 			emitq(NIL);
 		}
-		else if (OP_OPEN_OUTFILE == op) {
+		else if (OP_OPEN_OUTFILE == op || OP_SERIALIZE == op ||
+			 OP_DUMP_IMAGE == op || OP_DUMP_EXEC == op)
+		{
 			emitq(NIL);
 		}
 		else if (OP_NUMSTR == op || OP_STRNUM == op) {
 			emitq(Ten);
 		}
 		else if (OP_WRITEC == op ||
+			 OP_WRITEBLK == op ||
 			 OP_PRIN == op ||
 			 OP_PRINC == op)
 		{
 			emitop(OP_OUTPORT);
 		}
+		else if (OP_READBLK == op) {
+			emitop(OP_INPORT);
+		}
 	}
 	else {
 		if (OP_ERROR == op) op = OP_ERROR2;
@@ -3145,7 +3835,7 @@ cell compile(cell x) {
  * Macro expander
  */
 
-cell	Macros = NIL;
+THREAD cell	Macros = NIL;
 
 void newmacro(int id, cell fn) {
 	cell	n, name;
@@ -3258,7 +3948,7 @@ cell expanddef(cell x) {
 	return n;
 }
 
-volatile int	Mxlev = 0;
+THREAD volatile int	Mxlev = 0;
 
 cell eval(cell x, int r);
 
@@ -3346,7 +4036,7 @@ cell xsub(cell x, cell y) {
 }
 
 cell mul(cell x, cell y) {
-	int	a, b;
+	cell	a, b;
 
 	if (!numberp(x)) expect("*", "number", x);
 	if (!numberp(y)) expect("*", "number", y);
@@ -3360,11 +4050,11 @@ cell mul(cell x, cell y) {
 		if (0 == a || 0 == b) return Zero;
 		if (1 == a) return y;
 		if (1 == b) return x;
-		/* abs(INT_MIN) is undefined using two's complement, so */
-		if (INT_MIN == a || INT_MIN == b) fixover("*", x, y);
+		/* abs(CELL_MIN) is undefined using two's complement, so */
+		if (CELL_MIN == a || CELL_MIN == b) fixover("*", x, y);
 		/* Catch the rest */
-		/* Bug: result may not be INT_MIN */
-		if (abs(a) > INT_MAX / abs(b)) fixover("*", x, y);
+		/* Bug: result may not be CELL_MIN */
+		if (cellabs(a) > CELL_MAX / cellabs(b)) fixover("*", x, y);
 		return mkfix(a * b);
 	}
 	return mkfloat(numval(x) * numval(y));
@@ -3444,13 +4134,14 @@ void equal(cell x, cell y) {
 }
 
 cell bitop(cell x, cell y, cell o) {
-	uint	op, a, b;
-	int	i;
+	ucell	a, b;
+	cell	i;
+	int	op;
 
 	if (!fixp(o)) expect("bitop", "fixnum", o);
 	if (!fixp(x)) expect("bitop", "fixnum", x);
 	if (!fixp(y)) expect("bitop", "fixnum", y);
-	op = fixval(o);
+	op = (int) fixval(o);
 	b = fixval(x);
 	a = i = fixval(y);
 	switch (op) {
@@ -3525,101 +4216,284 @@ void cgteq(cell x, cell y) {
  */
 
 int scomp(cell x, cell y) {
-	int	kx, ky;
+	cell	kx, ky;
+	int	r;
 
-	kx = stringlen(x);
-	ky = stringlen(y);
-	if (kx == ky) return memcmp(string(x), string(y), kx);
-	return memcmp(string(x), string(y), 1+(kx<ky? kx: ky));
+	kx = strsize(x);
+	ky = strsize(y);
+	r = memcmp(strdata(x), strdata(y), kx<ky? kx: ky);
+	return r? r: (kx > ky) - (kx < ky);
 }
 
-int memcmp_ci(char *a, char *b, int k) {
-	int	i, d;
+/*
+ * The string scanners below process 16 bytes per step where
+ * SSE2 is available, and finish (or do all the work) in
+ * byte-wise loops. Case folding is limited to ASCII.
+ */
 
-	for (i=0; i<k; i++) {
-		d = tolower(a[i]) - tolower(b[i]);
-		if (d) return d;
-	}
-	return 0;
-}
+#define lcase(c)	((c) >= 'A' && (c) <= 'Z'? (c) | 0x20: (c))
+#define ucase(c)	((c) >= 'a' && (c) <= 'z'? (c) & ~0x20: (c))
 
-int scomp_ci(cell x, cell y) {
-	int	kx, ky;
+#ifdef __SSE2__
 
-	kx = stringlen(x);
-	ky = stringlen(y);
-	if (kx == ky)
-		return memcmp_ci((char *) string(x),
-				(char *) string(y), kx);
-	return memcmp_ci((char *) string(x), (char *) string(y),
-			1+(kx<ky? kx: ky));
+#define load16(p)	_mm_loadu_si128((__m128i *) (p))
+
+__m128i lcase16(__m128i x) {
+	__m128i	t;
+
+	t = _mm_add_epi8(x, _mm_set1_epi8((char) (128 - 'A')));
+	t = _mm_cmplt_epi8(t, _mm_set1_epi8((char) (-128 + 26)));
+	return _mm_or_si128(x, _mm_and_si128(t, _mm_set1_epi8(0x20)));
+}
+
+#endif
+
+int memcmp_ci(char *a, char *b, cell k) {
+	cell	i;
+	int	d;
+#ifdef __SSE2__
+	__m128i	x, y;
+
+	for (i=0; i+16 <= k; i += 16) {
+		x = lcase16(load16(&a[i]));
+		y = lcase16(load16(&b[i]));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xffff)
+			break;
+	}
+#else
+	i = 0;
+#endif
+	for (; i<k; i++) {
+		d = lcase((byte) a[i]) - lcase((byte) b[i]);
+		if (d) return d;
+	}
+	return 0;
+}
+
+/*
+ * Return the offset of the first byte of S[0..K-1] that
+ * equals C1 or C2, or -1 if there is no such byte.
+ */
+
+cell scanbyte(byte *s, cell k, int c1, int c2) {
+	cell	i;
+#ifdef __SSE2__
+	__m128i	v1, v2, x;
+
+	v1 = _mm_set1_epi8((char) c1);
+	v2 = _mm_set1_epi8((char) c2);
+	for (i=0; i+16 <= k; i += 16) {
+		x = load16(&s[i]);
+		x = _mm_or_si128(_mm_cmpeq_epi8(x, v1),
+				 _mm_cmpeq_epi8(x, v2));
+		if (_mm_movemask_epi8(x)) break;
+	}
+#else
+	i = 0;
+#endif
+	for (; i<k; i++)
+		if (s[i] == c1 || s[i] == c2) return i;
+	return -1;
+}
+
+cell countbyte(byte *s, cell k, int c) {
+	cell	i, n;
+#ifdef __SSE2__
+	int	j;
+	__m128i	v, z, a;
+
+	v = _mm_set1_epi8((char) c);
+	z = _mm_setzero_si128();
+	n = 0;
+	for (i=0; i+16 <= k; ) {
+		/* byte counters would overflow after 255 steps */
+		a = z;
+		for (j=0; j<255 && i+16 <= k; j++, i += 16)
+			a = _mm_sub_epi8(a, _mm_cmpeq_epi8(load16(&s[i]), v));
+		a = _mm_sad_epu8(a, z);
+		n += _mm_cvtsi128_si32(a) +
+		     _mm_cvtsi128_si32(_mm_srli_si128(a, 8));
+	}
+#else
+	i = n = 0;
+#endif
+	for (; i<k; i++)
+		if (s[i] == c) n++;
+	return n;
+}
+
+/*
+ * Find the first occurrence of U[0..KU-1] in S[0..KS-1].
+ * Candidate positions are located by scanning for the
+ * first character of U (in both cases, if CI is set).
+ */
+
+cell memsearch(byte *u, cell ku, byte *s, cell ks, int ci) {
+	cell	i, j;
+	int	c1, c2;
+
+	if (0 == ku) return 0;
+	c1 = c2 = u[0];
+	if (ci) {
+		c1 = lcase(c1);
+		c2 = ucase(c1);
+	}
+	for (i=0; i <= ks-ku; i += j+1) {
+		j = scanbyte(&s[i], ks-ku-i+1, c1, c2);
+		if (j < 0) return -1;
+		if (ci && 0 == memcmp_ci((char *) &u[1], (char *) &s[i+j+1],
+					 ku-1))
+			return i+j;
+		if (!ci && 0 == memcmp(&u[1], &s[i+j+1], ku-1))
+			return i+j;
+	}
+	return -1;
+}
+
+int scomp_ci(cell x, cell y) {
+	cell	kx, ky;
+	int	r;
+
+	kx = strsize(x);
+	ky = strsize(y);
+	r = memcmp_ci((char *) strdata(x), (char *) strdata(y),
+			kx<ky? kx: ky);
+	return r? r: (kx > ky) - (kx < ky);
+}
+
+cell strsearch(cell u, cell s, int ci) {
+	char	*who;
+	cell	i;
+
+	who = ci? "string-search-ci": "string-search";
+	if (!anystrp(u)) expect(who, "string", u);
+	if (!anystrp(s)) expect(who, "string", s);
+	i = memsearch(strdata(u), strsize(u), strdata(s), strsize(s), ci);
+	return i < 0? NIL: mkfix(i);
+}
+
+cell strindex(cell c, cell s) {
+	cell	i;
+
+	if (!charp(c)) expect("string-index", "char", c);
+	if (!anystrp(s)) expect("string-index", "string", s);
+	i = scanbyte(strdata(s), strsize(s), charval(c), charval(c));
+	return i < 0? NIL: mkfix(i);
+}
+
+cell strcount(cell c, cell s) {
+	if (!charp(c)) expect("string-count", "char", c);
+	if (!anystrp(s)) expect("string-count", "string", s);
+	return mkfix(countbyte(strdata(s), strsize(s), charval(c)));
+}
+
+/*
+ * Split S at each occurrence of C. Empty fields are kept, so
+ * a string with K delimiters always has K+1 fields. Offsets
+ * are used instead of pointers, because mkstr() may move S.
+ */
+
+cell strsplit(cell c, cell s, int vec) {
+	char	*who;
+	cell	n, a, x, i, j, k, m;
+	int	d;
+
+	who = vec? "string-fields": "string-split";
+	if (!charp(c)) expect(who, "char", c);
+	if (!anystrp(s)) expect(who, "string", s);
+	d = charval(c);
+	k = strsize(s);
+	protect(s);
+	if (vec)
+		n = mkvec(1 + countbyte(strdata(s), k, d));
+	else
+		n = cons(NIL, NIL);
+	protect(n);
+	a = n;
+	for (i = m = 0;; i += j+1, m++) {
+		j = scanbyte(strdata(s)+i, k-i, d, d);
+		if (j < 0) j = k-i;
+		x = mkstr(NULL, j);
+		memcpy(string(x), strdata(s)+i, j);
+		if (vec) {
+			vector(n)[m] = x;
+		}
+		else {
+			x = cons(x, NIL);
+			cdr(a) = x;
+			a = x;
+		}
+		if (i+j >= k) break;
+	}
+	unprot(2);
+	return vec? n: cdr(n);
 }
 
 cell sless(cell x, cell y) {
-	if (!string(x)) expect("s<", "string", x);
-	if (!string(y)) expect("s<", "string", y);
+	if (!anystrp(x)) expect("s<", "string", x);
+	if (!anystrp(y)) expect("s<", "string", y);
 	return scomp(x, y) < 0? TRUE: NIL;
 }
 
 cell slteq(cell x, cell y) {
-	if (!string(x)) expect("s<=", "string", x);
-	if (!string(y)) expect("s<=", "string", y);
+	if (!anystrp(x)) expect("s<=", "string", x);
+	if (!anystrp(y)) expect("s<=", "string", y);
 	return scomp(x, y) <= 0? TRUE: NIL;
 }
 
 cell sequal(cell x, cell y) {
-	if (!string(x)) expect("s=", "string", x);
-	if (!string(y)) expect("s=", "string", y);
-	if (stringlen(x) != stringlen(y)) return NIL;
+	if (!anystrp(x)) expect("s=", "string", x);
+	if (!anystrp(y)) expect("s=", "string", y);
+	if (strsize(x) != strsize(y)) return NIL;
 	return scomp(x, y) == 0? TRUE: NIL;
 }
 
 cell sgrtr(cell x, cell y) {
-	if (!string(x)) expect("s>", "string", x);
-	if (!string(y)) expect("s>", "string", y);
+	if (!anystrp(x)) expect("s>", "string", x);
+	if (!anystrp(y)) expect("s>", "string", y);
 	return scomp(x, y) > 0? TRUE: NIL;
 }
 
 cell sgteq(cell x, cell y) {
-	if (!string(x)) expect("s>=", "string", x);
-	if (!string(y)) expect("s>=", "string", y);
+	if (!anystrp(x)) expect("s>=", "string", x);
+	if (!anystrp(y)) expect("s>=", "string", y);
 	return scomp(x, y) >= 0? TRUE: NIL;
 }
 
 cell siless(cell x, cell y) {
-	if (!string(x)) expect("si<", "string", x);
-	if (!string(y)) expect("si<", "string", y);
+	if (!anystrp(x)) expect("si<", "string", x);
+	if (!anystrp(y)) expect("si<", "string", y);
 	return scomp_ci(x, y) < 0? TRUE: NIL;
 }
 
 cell silteq(cell x, cell y) {
-	if (!string(x)) expect("si<=", "string", x);
-	if (!string(y)) expect("si<=", "string", y);
+	if (!anystrp(x)) expect("si<=", "string", x);
+	if (!anystrp(y)) expect("si<=", "string", y);
 	return scomp_ci(x, y) <= 0? TRUE: NIL;
 }
 
 cell siequal(cell x, cell y) {
-	if (!string(x)) expect("si=", "string", x);
-	if (!string(y)) expect("si=", "string", y);
-	if (stringlen(x) != stringlen(y)) return NIL;
+	if (!anystrp(x)) expect("si=", "string", x);
+	if (!anystrp(y)) expect("si=", "string", y);
+	if (strsize(x) != strsize(y)) return NIL;
 	return scomp_ci(x, y) == 0? TRUE: NIL;
 }
 
 cell sigrtr(cell x, cell y) {
-	if (!string(x)) expect("si>", "string", x);
-	if (!string(y)) expect("si>", "string", y);
+	if (!anystrp(x)) expect("si>", "string", x);
+	if (!anystrp(y)) expect("si>", "string", y);
 	return scomp_ci(x, y) > 0? TRUE: NIL;
 }
 
 cell sigteq(cell x, cell y) {
-	if (!string(x)) expect("si>=", "string", x);
-	if (!string(y)) expect("si>=", "string", y);
+	if (!anystrp(x)) expect("si>=", "string", x);
+	if (!anystrp(y)) expect("si>=", "string", y);
 	return scomp_ci(x, y) >= 0? TRUE: NIL;
 }
 
 cell b_mkstr(cell x, cell a) {
-	cell	n;
-	int	i, c, k;
+	cell	n, i, k;
+	int	c;
 	byte	*s;
 
 	if (!fixp(x)) expect("mkstr", "fixnum", x);
@@ -3633,43 +4507,42 @@ cell b_mkstr(cell x, cell a) {
 }
 
 cell sconc(cell x) {
-	cell	p, n;
-	int	k, m;
+	cell	p, n, k, m;
 	byte	*s;
 
 	k = 0;
 	for (p = x; p != NIL; p = cdr(p)) {
-		if (!stringp(car(p)))
+		if (!anystrp(car(p)))
 			expect("sconc", "string", car(p));
-		k += stringlen(car(p))-1;
+		k += strsize(car(p));
 	}
 	n = mkstr(NULL, k);
 	s = string(n);
 	k = 0;
 	for (p = x; p != NIL; p = cdr(p)) {
-		m = stringlen(car(p));
-		memcpy(&s[k], string(car(p)), m);
-		k += m-1;
+		m = strsize(car(p));
+		memcpy(&s[k], strdata(car(p)), m);
+		k += m;
 	}
 	return n;
 }
 
 cell sref(cell s, cell n) {
-	int	i;
+	cell	i;
 
-	if (!stringp(s)) expect("sref", "string", s);
+	if (!anystrp(s)) expect("sref", "string", s);
 	if (!fixp(n)) expect("sref", "fixnum", n);
 	i = fixval(n);
-	if (i < 0 || i >= stringlen(s)-1)
+	if (i < 0 || i >= strsize(s))
 		error("sref: index out of range", n);
-	return mkchar(string(s)[i]);
+	return mkchar(strdata(s)[i]);
 }
 
 void sset(cell s, cell n, cell r) {
-	int	i;
+	cell	i;
 
-	if (!stringp(s)) expect("sset", "string", s);
-	if (constp(s)) error("sset: immutable", s);
+	if (!anystrp(s)) expect("sset", "string", s);
+	if (constp(s) || slicep(s)) error("sset: immutable", s);
 	if (!fixp(n)) expect("sset", "fixnum", n);
 	if (!charp(r)) expect("sset", "char", r);
 	i = fixval(n);
@@ -3679,36 +4552,29 @@ void sset(cell s, cell n, cell r) {
 }
 
 cell substr(cell s, cell n0, cell n1) {
-	int	k, k0, k1, i, j;
+	cell	k, k0, k1;
 	cell	n;
-	byte	*s0, *s1;
 
-	if (!stringp(s)) expect("substr", "string", s);
+	if (!anystrp(s)) expect("substr", "string", s);
 	if (!fixp(n0)) expect("substr", "fixnum", n0);
 	if (!fixp(n1)) expect("substr", "fixnum", n1);
 	k0 = fixval(n0);
 	k1 = fixval(n1);
-	if (k0 < 0 || k1 < 0 || k0 > k1 || k1 >= stringlen(s))
+	if (k0 < 0 || k1 < 0 || k0 > k1 || k1 > strsize(s))
 		error("substr: invalid range", cons(n0, cons(n1, NIL)));
 	k = k1-k0;
 	n = mkstr(NULL, k);
-	j = 0;
-	s0 = string(s);
-	s1 = string(n);
-	for (i=k0; i<k1; i++) {
-		s1[j] = s0[i];
-		j++;
-	}
-	s1[j] = 0;
+	memcpy(string(n), strdata(s) + k0, k);
 	return n;
 }
 
 void sfill(cell x, cell a) {
-	int	c, i, k;
+	cell	i, k;
+	int	c;
 	byte	*s;
 
-	if (!stringp(x)) expect("sfill", "string", x);
-	if (constp(x)) error("sfill: immutable", x);
+	if (!anystrp(x)) expect("sfill", "string", x);
+	if (constp(x) || slicep(x)) error("sfill: immutable", x);
 	if (!charp(a)) expect("sfill", "char", a);
 	c = charval(a);
 	k = stringlen(x)-1;
@@ -3721,8 +4587,7 @@ void sfill(cell x, cell a) {
  */
 
 cell b_mkvec(cell x, cell a) {
-	cell	n;
-	int	i, k;
+	cell	n, i, k;
 	cell	*v;
 
 	if (!fixp(x)) expect("mkvec", "fixnum", x);
@@ -3739,48 +4604,48 @@ cell vconc(cell x) {
 
 	k = 0;
 	for (p = x; p != NIL; p = cdr(p)) {
-		if (!vectorp(car(p)))
+		if (!anyvecp(car(p)))
 			expect("vconc", "vector", car(p));
-		k += veclen(car(p));
+		k += vecitems(car(p));
 	}
 	n = mkvec(k);
 	v = vector(n);
 	k = 0;
 	for (p = x; p != NIL; p = cdr(p)) {
-		m = veclen(car(p));
-		memcpy(&v[k], vector(car(p)), m*sizeof(cell));
+		m = vecitems(car(p));
+		memcpy(&v[k], vecdata(car(p)), m*sizeof(cell));
 		k += m;
 	}
 	return n;
 }
 
 cell vref(cell x, cell n) {
-	int	i;
+	cell	i;
 
-	if (!vectorp(x)) expect("vref", "vector", x);
+	if (!anyvecp(x)) expect("vref", "vector", x);
 	if (!fixp(n)) expect("vref", "fixnum", n);
 	i = fixval(n);
-	if (i < 0 || i >= veclen(x))
+	if (i < 0 || i >= vecitems(x))
 		error("vref: index out of range", n);
-	return vector(x)[i];
+	return vecdata(x)[i];
 }
 
 void vfill(cell x, cell a) {
 	int	i, k;
 	cell	*v;
 
-	if (!vectorp(x)) expect("vfill", "vector", x);
-	if (constp(x)) error("vfill: immutable", x);
+	if (!anyvecp(x)) expect("vfill", "vector", x);
+	if (constp(x) || slicep(x)) error("vfill: immutable", x);
 	k = veclen(x);
 	v = vector(x);
 	for (i=0; i<k; i++) v[i] = a;
 }
 
 void vset(cell v, cell n, cell r) {
-	int	i;
+	cell	i;
 
-	if (!vectorp(v)) expect("vset", "vector", v);
-	if (constp(v)) error("vset: immutable", v);
+	if (!anyvecp(v)) expect("vset", "vector", v);
+	if (constp(v) || slicep(v)) error("vset: immutable", v);
 	if (!fixp(n)) expect("vset", "fixnum", n);
 	i = fixval(n);
 	if (i < 0 || i >= veclen(v))
@@ -3789,29 +4654,493 @@ void vset(cell v, cell n, cell r) {
 }
 
 cell subvec(cell v, cell n0, cell n1) {
-	int	k, k0, k1, i, j;
+	cell	k, k0, k1;
 	cell	n;
-	cell	*v0, *v1;
 
-	if (!vectorp(v)) expect("subvec", "vector", v);
+	if (!anyvecp(v)) expect("subvec", "vector", v);
 	if (!fixp(n0)) expect("subvec", "fixnum", n0);
 	if (!fixp(n1)) expect("subvec", "fixnum", n1);
 	k0 = fixval(n0);
 	k1 = fixval(n1);
-	if (k0 < 0 || k1 < 0 || k0 > k1 || k1 > veclen(v))
+	if (k0 < 0 || k1 < 0 || k0 > k1 || k1 > vecitems(v))
 		error("subvec: invalid range", cons(n0, cons(n1, NIL)));
 	k = k1-k0;
 	n = mkvec(k);
-	j = 0;
-	v0 = vector(v);
-	v1 = vector(n);
-	for (i=k0; i<k1; i++) {
-		v1[j] = v0[i];
-		j++;
+	memcpy(vector(n), vecdata(v) + k0, k * sizeof(cell));
+	return n;
+}
+
+/*
+ * Inline functions, slices
+ */
+
+cell slice(cell x, cell n0, cell n1) {
+	cell	k, k0, k1;
+
+	if (!anystrp(x) && !anyvecp(x))
+		expect("slice", "string or vector", x);
+	if (!fixp(n0)) expect("slice", "fixnum", n0);
+	if (!fixp(n1)) expect("slice", "fixnum", n1);
+	k0 = fixval(n0);
+	k1 = fixval(n1);
+	k = anystrp(x)? strsize(x): vecitems(x);
+	if (k0 < 0 || k1 < 0 || k0 > k1 || k1 > k)
+		error("slice: invalid range", cons(n0, cons(n1, NIL)));
+	return mkslice(x, k0, k1-k0);
+}
+
+/*
+ * Inline functions, typed arrays
+ *
+ * Typed arrays keep unboxed doubles (f64), ints (s32), or
+ * bytes (u8) in the vector pool. Their payload is not traversed
+ * by mark(). Vector payloads are only cell-aligned, so doubles
+ * are accessed through memcpy() or unaligned loads.
+ */
+
+#define AOP_MK		0
+#define AOP_REF		1
+#define AOP_SIZE	2
+#define AOP_FILL	3
+#define AOP_COPY	4
+#define AOP_TYPE	5
+#define AOP_LIST	6
+#define AOP_ADD		7
+#define AOP_SUB		8
+#define AOP_MUL		9
+#define AOP_DIV		10
+#define AOP_SUM		11
+#define AOP_DOT		12
+#define AOP_MIN		13
+#define AOP_MAX		14
+#define AOP_MAP		15
+
+char	*Aopname[] = {
+		"mkarray", "aref", "asize", "afill", "acopy", "atype",
+		"arraylist", "a+", "a-", "a*", "a/", "asum", "adot",
+		"amin", "amax", "amap" };
+
+double getf64(byte *p, cell i) {
+	double	d;
+
+	memcpy(&d, &p[i * sizeof(double)], sizeof(double));
+	return d;
+}
+
+void setf64(byte *p, cell i, double d) {
+	memcpy(&p[i * sizeof(double)], &d, sizeof(double));
+}
+
+cell mkarray(cell type, cell k) {
+	cell	n;
+
+	if (k > NVCELLS * (cell) sizeof(cell) / elsize(type))
+		error("mkarray: size out of range", mkfix(k));
+	n = newvec(type, k * elsize(type));
+	memset(string(n), 0, k * elsize(type));
+	return n;
+}
+
+double aval(cell a, cell i) {
+	if (T_F64 == car(a)) return getf64(string(a), i);
+	if (T_S32 == car(a)) return ((int *) string(a))[i];
+	return string(a)[i];
+}
+
+cell aobj(cell a, cell i) {
+	if (T_F64 == car(a)) return mkfloat(getf64(string(a), i));
+	if (T_S32 == car(a)) return mkfix(((int *) string(a))[i]);
+	return mkfix(string(a)[i]);
+}
+
+void aput(char *who, cell a, cell i, cell x) {
+	char	b[100];
+	cell	v;
+
+	if (T_F64 == car(a)) {
+		if (!numberp(x)) expect(who, "number", x);
+		setf64(string(a), i, numval(x));
+		return;
+	}
+	if (!fixp(x)) expect(who, "fixnum", x);
+	v = fixval(x);
+	if (T_S32 == car(a)? v < INT_MIN || v > INT_MAX: v < 0 || v > 255) {
+		sprintf(b, "%s: value out of range", who);
+		error(b, x);
+	}
+	if (T_S32 == car(a))
+		((int *) string(a))[i] = (int) v;
+	else
+		string(a)[i] = v;
+}
+
+/*
+ * Reductions deliver fixnums for integer arrays when the
+ * result is representable as a fixnum.
+ */
+
+cell anum(cell type, double d) {
+	if (T_F64 == type || d != floor(d) || d < CELL_MIN || d >= CELL_MAX + 1.0)
+		return mkfloat(d);
+	return mkfix((cell) d);
+}
+
+void f64op(int op, byte *r, byte *a, byte *b, double s, cell k) {
+	cell	i;
+	double	x, y;
+#ifdef __SSE2__
+	__m128d	u, v;
+
+	v = _mm_set1_pd(s);
+	for (i=0; i+2 <= k; i += 2) {
+		u = _mm_loadu_pd((double *) &a[i * sizeof(double)]);
+		if (b) v = _mm_loadu_pd((double *) &b[i * sizeof(double)]);
+		switch (op) {
+		case AOP_ADD: u = _mm_add_pd(u, v); break;
+		case AOP_SUB: u = _mm_sub_pd(u, v); break;
+		case AOP_MUL: u = _mm_mul_pd(u, v); break;
+		case AOP_DIV: u = _mm_div_pd(u, v); break;
+		}
+		_mm_storeu_pd((double *) &r[i * sizeof(double)], u);
+	}
+#else
+	i = 0;
+#endif
+	for (; i<k; i++) {
+		x = getf64(a, i);
+		y = b? getf64(b, i): s;
+		switch (op) {
+		case AOP_ADD: x += y; break;
+		case AOP_SUB: x -= y; break;
+		case AOP_MUL: x *= y; break;
+		case AOP_DIV: x /= y; break;
+		}
+		setf64(r, i, x);
+	}
+}
+
+/*
+ * Integer arithmetics wraps around, like in C.
+ */
+
+void s32op(int op, int *r, int *a, int *b, int s, cell k) {
+	cell	i;
+	int	y;
+#ifdef __SSE2__
+	__m128i	u, v;
+
+	v = _mm_set1_epi32(s);
+	for (i=0; i+4 <= k && (AOP_ADD == op || AOP_SUB == op); i += 4) {
+		u = load16(&a[i]);
+		if (b) v = load16(&b[i]);
+		u = AOP_ADD == op? _mm_add_epi32(u, v): _mm_sub_epi32(u, v);
+		_mm_storeu_si128((__m128i *) &r[i], u);
+	}
+#else
+	i = 0;
+#endif
+	for (; i<k; i++) {
+		y = b? b[i]: s;
+		switch (op) {
+		case AOP_ADD: r[i] = (uint) a[i] + (uint) y; break;
+		case AOP_SUB: r[i] = (uint) a[i] - (uint) y; break;
+		case AOP_MUL: r[i] = (uint) a[i] * (uint) y; break;
+		case AOP_DIV:
+			if (0 == y) error("a/: division by zero", UNDEF);
+			r[i] = -1 == y? -(uint) a[i]: a[i] / y;
+			break;
+		}
+	}
+}
+
+void u8op(int op, byte *r, byte *a, byte *b, int s, cell k) {
+	cell	i;
+	int	y;
+#ifdef __SSE2__
+	__m128i	u, v;
+
+	v = _mm_set1_epi8((char) s);
+	for (i=0; i+16 <= k && (AOP_ADD == op || AOP_SUB == op); i += 16) {
+		u = load16(&a[i]);
+		if (b) v = load16(&b[i]);
+		u = AOP_ADD == op? _mm_add_epi8(u, v): _mm_sub_epi8(u, v);
+		_mm_storeu_si128((__m128i *) &r[i], u);
+	}
+#else
+	i = 0;
+#endif
+	for (; i<k; i++) {
+		y = b? b[i]: s & 0xff;
+		switch (op) {
+		case AOP_ADD: r[i] = a[i] + y; break;
+		case AOP_SUB: r[i] = a[i] - y; break;
+		case AOP_MUL: r[i] = a[i] * y; break;
+		case AOP_DIV:
+			if (0 == y) error("a/: division by zero", UNDEF);
+			r[i] = a[i] / y;
+			break;
+		}
+	}
+}
+
+cell abinop(int op, cell a, cell b) {
+	cell	n, k;
+	int	s;
+	double	d;
+
+	k = arrlen(a);
+	if (arrayp(b)) {
+		if (car(a) != car(b))
+			error("array type mismatch", cons(a, cons(b, NIL)));
+		if (arrlen(b) != k)
+			error("array size mismatch", cons(a, cons(b, NIL)));
+		d = s = 0;
+	}
+	else if (T_F64 == car(a)) {
+		if (!numberp(b)) expect(Aopname[op], "number", b);
+		d = numval(b);
+		s = 0;
+	}
+	else {
+		if (!fixp(b)) expect(Aopname[op], "fixnum", b);
+		s = fixval(b);
+		d = 0;
+	}
+	n = mkarray(car(a), k);
+	switch (car(a)) {
+	case T_F64:
+		f64op(op, string(n), string(a),
+			arrayp(b)? string(b): NULL, d, k);
+		break;
+	case T_S32:
+		s32op(op, (int *) string(n), (int *) string(a),
+			arrayp(b)? (int *) string(b): NULL, s, k);
+		break;
+	default:
+		u8op(op, string(n), string(a),
+			arrayp(b)? string(b): NULL, s, k);
+		break;
+	}
+	return n;
+}
+
+/*
+ * Sum of A[i], or sum of A[i]*B[i] when B is an array.
+ */
+
+double asum(cell a, cell b) {
+	cell	i, k;
+	double	d;
+	byte	*p, *q;
+#ifdef __SSE2__
+	__m128d	u;
+#endif
+
+	k = arrlen(a);
+	d = 0;
+	if (T_F64 == car(a)) {
+		p = string(a);
+		q = NIL == b? NULL: string(b);
+#ifdef __SSE2__
+		u = _mm_setzero_pd();
+		for (i=0; i+2 <= k; i += 2) {
+			if (q)
+				u = _mm_add_pd(u, _mm_mul_pd(
+				    _mm_loadu_pd((double *) &p[i*sizeof(double)]),
+				    _mm_loadu_pd((double *) &q[i*sizeof(double)])));
+			else
+				u = _mm_add_pd(u,
+				    _mm_loadu_pd((double *) &p[i*sizeof(double)]));
+		}
+		d = _mm_cvtsd_f64(u) + _mm_cvtsd_f64(_mm_unpackhi_pd(u, u));
+#else
+		i = 0;
+#endif
+		for (; i<k; i++)
+			d += q? getf64(p, i) * getf64(q, i): getf64(p, i);
+		return d;
+	}
+	for (i=0; i<k; i++)
+		d += NIL == b? aval(a, i): aval(a, i) * aval(b, i);
+	return d;
+}
+
+double aminmax(cell a, int max) {
+	cell	i, k;
+	double	d, x;
+	byte	*p;
+#ifdef __SSE2__
+	__m128d	u, v;
+#endif
+
+	k = arrlen(a);
+	if (0 == k) error(max? "amax: empty array": "amin: empty array", a);
+	d = aval(a, 0);
+	i = 1;
+	if (T_F64 == car(a)) {
+		p = string(a);
+#ifdef __SSE2__
+		u = _mm_set1_pd(d);
+		for (i=0; i+2 <= k; i += 2) {
+			v = _mm_loadu_pd((double *) &p[i * sizeof(double)]);
+			u = max? _mm_max_pd(u, v): _mm_min_pd(u, v);
+		}
+		v = _mm_unpackhi_pd(u, u);
+		u = max? _mm_max_sd(u, v): _mm_min_sd(u, v);
+		d = _mm_cvtsd_f64(u);
+#endif
+	}
+	for (; i<k; i++) {
+		x = aval(a, i);
+		if (max? x > d: x < d) d = x;
 	}
+	return d;
+}
+
+cell	*Amapfns[] = {
+	&P_abs, &P_acos, &P_asin, &P_atan, &P_ceiling, &P_cos, &P_exp,
+	&P_floor, &P_log, &P_sin, &P_sqrt, &P_tan, NULL };
+
+/*
+ * Return the name of the built-in math function F, or F itself,
+ * if it is not one of them.
+ */
+
+cell amapname(cell f) {
+	cell	n, **v;
+
+	for (v = Amapfns; *v != NULL; v++) {
+		n = assq(**v, Glob);
+		if (n != NIL && cadr(n) == f)
+			return **v;
+	}
+	return f;
+}
+
+cell amap(cell f, cell a) {
+	cell	n, i, k;
+	double	(*fn)(double);
+	byte	*r;
+
+	if (!symbolp(f)) f = amapname(f);
+	if (f == P_acos) fn = acos;
+	else if (f == P_asin) fn = asin;
+	else if (f == P_atan) fn = atan;
+	else if (f == P_ceiling) fn = ceil;
+	else if (f == P_cos) fn = cos;
+	else if (f == P_exp) fn = exp;
+	else if (f == P_abs) fn = fabs;
+	else if (f == P_floor) fn = floor;
+	else if (f == P_log) fn = log;
+	else if (f == P_sin) fn = sin;
+	else if (f == P_sqrt) fn = sqrt;
+	else if (f == P_tan) fn = tan;
+	else error("amap: unsupported function", f);
+	k = arrlen(a);
+	n = mkarray(T_F64, k);
+	r = string(n);
+	for (i=0; i<k; i++)
+		setf64(r, i, fn(aval(a, i)));
 	return n;
 }
 
+cell arraylist(cell a) {
+	cell	x, new, k, i;
+
+	k = arrlen(a);
+	if (0 == k) return NIL;
+	protect(x = cons(NIL, NIL));
+	for (i=0; i<k; i++) {
+		new = aobj(a, i);
+		car(x) = new;
+		if (i < k-1) {
+			new = cons(NIL, NIL);
+			cdr(x) = new;
+			x = cdr(x);
+		}
+	}
+	return unprot(1);
+}
+
+cell	S_f64, S_s32, S_u8;
+
+cell arrayop(cell o, cell x, cell y) {
+	cell	i, k, t;
+	cell	n = NIL; /*LINT*/
+	int	op;
+
+	if (!fixp(o)) expect("arrayop", "fixnum", o);
+	op = (int) fixval(o);
+	if (op < AOP_MK || op > AOP_MAP)
+		error("arrayop: invalid opcode", o);
+	if (AOP_MK == op) {
+		if (S_f64 == x) t = T_F64;
+		else if (S_s32 == x) t = T_S32;
+		else if (S_u8 == x) t = T_U8;
+		else error("mkarray: invalid type", x);
+		if (!fixp(y)) expect("mkarray", "fixnum", y);
+		if (fixval(y) < 0) error("mkarray: invalid size", y);
+		return mkarray(t, fixval(y));
+	}
+	if (AOP_TYPE == op) {
+		if (!arrayp(x)) return NIL;
+		return T_F64 == car(x)? S_f64: T_S32 == car(x)? S_s32: S_u8;
+	}
+	if (AOP_MAP == op) {
+		n = x;
+		x = y;
+	}
+	if (!arrayp(x)) expect(Aopname[op], "array", x);
+	k = arrlen(x);
+	switch (op) {
+	case AOP_REF:
+		if (!fixp(y)) expect("aref", "fixnum", y);
+		i = fixval(y);
+		if (i < 0 || i >= k) error("aref: index out of range", y);
+		return aobj(x, i);
+	case AOP_SIZE:
+		return mkfix(k);
+	case AOP_FILL:
+		for (i=0; i<k; i++) aput("afill", x, i, y);
+		return x;
+	case AOP_COPY:
+		n = mkarray(car(x), k);
+		memcpy(string(n), string(x), stringlen(x));
+		return n;
+	case AOP_LIST:
+		return arraylist(x);
+	case AOP_ADD:
+	case AOP_SUB:
+	case AOP_MUL:
+	case AOP_DIV:
+		return abinop(op, x, y);
+	case AOP_SUM:
+		return anum(car(x), asum(x, NIL));
+	case AOP_DOT:
+		if (!arrayp(y) || car(x) != car(y))
+			expect("adot", "array of the same type", y);
+		if (arrlen(y) != k)
+			error("array size mismatch", cons(x, cons(y, NIL)));
+		return anum(car(x), asum(x, y));
+	case AOP_MIN:
+	case AOP_MAX:
+		return anum(car(x), aminmax(x, AOP_MAX == op));
+	default: /* AOP_MAP */
+		return amap(n, x);
+	}
+}
+
+void aset(cell a, cell n, cell x) {
+	cell	i;
+
+	if (!arrayp(a)) expect("aset", "array", a);
+	if (!fixp(n)) expect("aset", "fixnum", n);
+	i = fixval(n);
+	if (i < 0 || i >= arrlen(a))
+		error("aset: index out of range", n);
+	aput("aset", a, i, x);
+}
+
 /*
  * Inline functions, file I/O
  */
@@ -3848,17 +5177,142 @@ cell openfile(cell x, int mode) {
 }
 
 cell b_readc(cell p, int rej) {
-	int	pp, c;
+	int	c;
 
-	pp = Inport;
-	if (p != pp) set_inport(p);
-	c = readc();
-	if (rej) rejectc(c);
-	if (p != pp) set_inport(pp);
+	if (Port_fd[p] < 0)
+		fatal("readc: input port is not open");
+	c = getport(p);
+	if (EOF == c && (Port_flags[p] & PAGAIN_TAG)) return NIL;
+	if (rej) rejectport(p, c);
 	if (EOF == c) return EOFMARK;
 	return mkchar(c);
 }
 
+/*
+ * Read a line from port P directly out of the port buffer.
+ * Only lines that span a buffer boundary are collected in a
+ * temporary buffer.
+ *
+ * When the input would block before a complete line has been
+ * read, the partial line is put back into the (empty) buffer.
+ */
+
+cell b_readln(int p) {
+	byte	*s, *t, *b;
+	cell	x, i, k, n, m;
+
+	if (Port_fd[p] < 0)
+		fatal("readln: input port is not open");
+	t = NULL;
+	n = m = 0;
+	for (;;) {
+		if (Port_pos[p] >= Port_lim[p]) {
+			if (EOF == fillport(p)) break;
+			Port_pos[p]--;
+		}
+		s = &Port_buf[p][Port_pos[p]];
+		k = Port_lim[p] - Port_pos[p];
+		i = scanbyte(s, k, '\n', '\n');
+		if (i >= 0 && NULL == t) {
+			Port_pos[p] += i+1;
+			return mkstr((char *) s, i);
+		}
+		if (i >= 0) k = i;
+		if (n + k > m) {
+			m = m? m*2: PORTBUFSIZE;
+			while (n + k > m) m *= 2;
+			if ((b = realloc(t, m)) == NULL) {
+				free(t);
+				fatal("readln: out of physical memory");
+			}
+			t = b;
+		}
+		memcpy(&t[n], s, k);
+		n += k;
+		Port_pos[p] += i >= 0? i+1: k;
+		if (i >= 0) break;
+	}
+	if (Port_flags[p] & PAGAIN_TAG) {
+		if (n > Port_size[p]) {
+			if ((b = realloc(Port_buf[p], n)) == NULL) {
+				free(t);
+				fatal("readln: out of physical memory");
+			}
+			Port_buf[p] = b;
+			Port_size[p] = n;
+		}
+		if (n) memcpy(Port_buf[p], t, n);
+		Port_pos[p] = 0;
+		Port_lim[p] = n;
+		free(t);
+		return NIL;
+	}
+	if (NULL == t) return EOFMARK;
+	x = mkstr((char *) t, n);
+	free(t);
+	return x;
+}
+
+/*
+ * Read up to N chars from port P. Fewer chars are delivered
+ * only at the end of the input or when reading more would
+ * block. Blocks that do not fit in the buffer are read directly
+ * into the resulting string.
+ */
+
+cell readblock(cell x, int p, cell type) {
+	cell	n, m;
+	int	i, k, r;
+	char	*who;
+
+	who = T_U8 == type? "read-bytes": "read-block";
+	if (!fixp(x)) expect(who, "fixnum", x);
+	if (fixval(x) < 0 || fixval(x) > INT_MAX)
+		error(T_U8 == type? "read-bytes: invalid size":
+				    "read-block: invalid size", x);
+	if (Port_fd[p] < 0)
+		error(T_U8 == type? "read-bytes: port is not open":
+				    "read-block: port is not open", UNDEF);
+	k = fixval(x);
+	if (0 == k) return T_U8 == type? mkarray(T_U8, 0): Nullstr;
+	Port_flags[p] &= ~PAGAIN_TAG;
+	n = T_U8 == type? mkarray(T_U8, k): mkstr(NULL, k);
+	r = Port_lim[p] - Port_pos[p];
+	i = r < k? r: k;
+	memcpy(string(n), &Port_buf[p][Port_pos[p]], i);
+	Port_pos[p] += i;
+	while (i < k) {
+		if (Port_flags[p] & PEOF_TAG) {
+			Port_flags[p] &= ~PEOF_TAG;
+			break;
+		}
+		if (k-i >= Port_size[p] && !(Port_flags[p] & PMAP_TAG)) {
+			r = read(Port_fd[p], &string(n)[i], k-i);
+			if (r < 0 && wouldblock())
+				Port_flags[p] |= PAGAIN_TAG;
+			if (r <= 0) break;
+			i += r;
+		}
+		else {
+			if (EOF == fillport(p)) break;
+			Port_pos[p] = 0;
+			r = Port_lim[p] < k-i? Port_lim[p]: k-i;
+			memcpy(&string(n)[i], Port_buf[p], r);
+			Port_pos[p] = r;
+			i += r;
+		}
+	}
+	if (0 == i) return Port_flags[p] & PAGAIN_TAG? NIL: EOFMARK;
+	if (i < k) {
+		protect(n);
+		m = T_U8 == type? mkarray(T_U8, i): mkstr(NULL, i);
+		memcpy(string(m), string(n), i);
+		unprot(1);
+		n = m;
+	}
+	return n;
+}
+
 cell b_read(cell ps) {
 	int	pp;
 	cell	n;
@@ -3888,29 +5342,94 @@ void b_prin(cell x, int p, int sl) {
 	if (p != pp) set_outport(pp);
 }
 
-cell format(cell x) {
-	cell	n;
+cell	S_none, S_line, S_full;
 
-	Outstr = mkstr(NULL, 1000);
-	Outmax = 1000;
-	Outptr = 0;
-	prex(1, x, 0);
-	n = mkstr(NULL, Outptr);
-	memcpy(string(n), string(Outstr), Outptr+1);
-	Outstr = NIL;
-	return n;
+cell setbufmode(cell x, cell m) {
+	int	p, f;
+	byte	*b;
+
+	if (!outportp(x)) expect("set-buffer-mode", "outport", x);
+	p = portno(x);
+	if (Port_fd[p] < 0) return x;
+	f = Port_flags[p] & ~(PLINE_TAG | PNOBUF_TAG);
+	if (S_none == m) {
+		f |= PNOBUF_TAG;
+	}
+	else if (S_line == m) {
+		f |= PLINE_TAG;
+	}
+	else if (fixp(m)) {
+		if (fixval(m) < 1 || fixval(m) > INT_MAX)
+			error("set-buffer-mode: invalid size", m);
+		if (flushport(p) < 0)
+			error("file write error, port", x);
+		if ((b = realloc(Port_buf[p], fixval(m))) == NULL)
+			error("set-buffer-mode: out of memory", m);
+		Port_buf[p] = b;
+		Port_size[p] = fixval(m);
+	}
+	else if (m != S_full) {
+		error("set-buffer-mode: invalid mode", m);
+	}
+	Port_flags[p] = f;
+	if ((f & PNOBUF_TAG) && flushport(p) < 0)
+		error("file write error, port", x);
+	return x;
 }
 
-void b_writec(int c, cell p) {
-	int	pp;
+cell strport_string(int p) {
+	cell	n, k;
 
-	pp = Outport;
-	if (p != pp) set_outport(p);
-	writec(c);
-	if (p != pp) set_outport(pp);
+	k = Port_ptr[p];
+	n = mkstr(NULL, k);
+	memcpy(string(n), string(Port_str[p]), k);
+	return n;
 }
 
-void b_rename(int old, int new) {
+cell openstring(void) {
+	int	p;
+
+	p = open_strport();
+	if (p < 0) error("open-outstring: out of ports", UNDEF);
+	return mkport(p, T_OUTPORT);
+}
+
+THREAD int	Fmtport = -1,
+		Fmtout = 1;
+
+cell format(cell x) {
+	cell	n;
+	int	p;
+
+	p = open_strport();
+	if (p < 0) error("format: out of ports", UNDEF);
+	Fmtport = p;
+	Fmtout = set_outport(p);
+	prex(1, x, 0);
+	n = strport_string(p);
+	abort_format();
+	return n;
+}
+
+void abort_format(void) {
+	if (Fmtport < 0) return;
+	set_outport(Fmtout);
+	close_port(Fmtport);
+	Fmtport = -1;
+}
+
+void b_writec(int c, cell p) {
+	char	b[1];
+
+	b[0] = c;
+	writeport(p, b, 1);
+}
+
+void b_rename(cell old, cell new) {
+	old = unslice(old);
+	protect(old);
+	new = unslice(new);
+	unprot(1);
 	if (!stringp(old)) expect("rename", "string", old);
 	if (!stringp(new)) expect("rename", "string", new);
 	if (rename((char *) string(old), (char *) string(new)) < 0)
@@ -3919,404 +5438,3333 @@ void b_rename(int old, int new) {
 }
 
 /*
- * Inline functions, lists
+ * Inline functions, binary I/O
  */
 
-cell lconc(cell x) {
-	cell	p, q, n, m;
-	int	k;
+#define POP_READ	0
+#define POP_WRITE	1
+#define POP_POS		2
+#define POP_SEEK	3
+#define POP_SEEKCUR	4
+#define POP_SEEKEND	5
+#define POP_PREAD	6
+#define POP_COPY	7
+#define POP_COPYFILE	8
+#define POP_BLOCKING	9
+#define POP_WATCH	10
+#define POP_WATCHER	11
+#define POP_WAIT	12
+#define POP_CONNECT	13
+#define POP_LISTEN	14
+#define POP_ACCEPT	15
+#define POP_SPAWN	16
+#define POP_WAITPID	17
+#define POP_FORK	18
+#define POP_NCPUS	19
 
-	if (NIL == cdr(x)) return car(x);
-	protect(n = cons(NIL, NIL));
-	k = 0;
-	for (p = x; cdr(p) != NIL; p = cdr(p)) {
-		if (NIL == car(p)) continue;
-		for (q = car(p); q != NIL; q = cdr(q)) {
-			if (!pairp(q))
-				expect("conc", "list", car(p));
-			if (k != 0) {
-				m = cons(NIL, NIL);
-				cdr(n) = m;
-				n = cdr(n);
-			}
-			car(n) = car(q);
-			k++;
+/*
+ * Copy up to N bytes (all, if N < 0) from descriptor IN to OUT
+ * without moving them through user space. Return the number of
+ * bytes copied, -1 if the kernel cannot copy between the given
+ * descriptors (so nothing has been copied), or -2 in case of an
+ * I/O error.
+ */
+
+long kcopy(int in, int out, long n) {
+#ifdef __linux__
+	long	r, k, total = 0;
+	int	sf = 0;
+
+	for (;;) {
+		k = n < 0 || n - total > 0x40000000L? 0x40000000L: n - total;
+		if (0 == k) break;
+ #ifdef SYS_copy_file_range
+		if (!sf)
+			r = syscall(SYS_copy_file_range, in, NULL, out, NULL,
+				k, 0);
+		else
+ #else
+		sf = 1;
+ #endif
+			r = sendfile(out, in, NULL, k);
+		if (r < 0 && EINTR == errno) continue;
+		if (r < 0 && 0 == total && !sf) {
+			sf = 1;
+			continue;
 		}
+		if (r < 0) return total? -2: -1;
+		if (0 == r) break;
+		total += r;
 	}
-	m = unprot(1);
-	if (0 == k) return car(p);
-	cdr(n) = car(p);
-	return m;
+	return total;
+#else
+	return -1;
+#endif
 }
 
-cell nlconc(cell x) {
-	cell	p, q;
+/*
+ * Copy through the buffer of IN; this works for all kinds of
+ * ports, including mapped files and string output ports.
+ */
 
-	while (pairp(cdr(x)) && NIL == car(x)) x = cdr(x);
-	if (NIL == cdr(x)) return car(x);
-	for (p = x; cdr(p) != NIL; p = cdr(p)) {
-		if (NIL == car(p)) continue;
-		if (constp(car(p))) error("nconc: immutable", car(p));
-		for (q = car(p); cdr(q) != NIL; q = cdr(q)) {
-			if (!pairp(q))
-				expect("nconc", "list", car(p));
+long bufcopy(int in, int out, long n) {
+	long	total = 0;
+	int	k;
+
+	for (;;) {
+		if (Port_pos[in] >= Port_lim[in]) {
+			if (EOF == fillport(in)) break;
+			Port_pos[in]--;
 		}
-		while (pairp(cdr(p)) && NIL == cadr(p))
-			p = cdr(p);
-		if (NIL == cdr(p)) break;
-		cdr(q) = cadr(p);
+		k = Port_lim[in] - Port_pos[in];
+		if (n >= 0 && k > n - total) k = n - total;
+		if (0 == k) break;
+		writeport(out, (char *) &Port_buf[in][Port_pos[in]], k);
+		Port_pos[in] += k;
+		total += k;
 	}
-	return car(x);
+	return total;
 }
 
 /*
- * Inline functions, type conversion
+ * Chars that are already in the buffer of IN are copied first,
+ * then the kernel copies the rest, if possible.
  */
 
-cell b_symbol(cell x) {
-	cell	y, n, k;
-
-	y = findsym((char *) string(x));
-	if (y != NIL) return y;
-	/*
-	 * Cannot pass content to mksym(), because
-	 * string(x) may move during GC.
-	 */
-	k = stringlen(x);
-	n = mksym("", k-1);
-	memcpy(symname(n), string(x), k);
-	return intern(n);
+long copyport(int in, int out, long n) {
+	long		total, r;
+	sigset_t	old;
+	int		pend;
+
+	total = Port_lim[in] - Port_pos[in];
+	if (n >= 0 && total > n) total = n;
+	if (total > 0) bufcopy(in, out, total);
+	if (n >= 0 && total >= n) return total;
+	if (	Port_str[out] != NIL ||
+		(Port_flags[in] & (PMAP_TAG | PEOF_TAG))
+	)
+		return total + bufcopy(in, out, n < 0? n: n - total);
+	if (flushport(out) < 0)
+		error("file write error, port", mkport(out, T_OUTPORT));
+	if (quietport(out)) {
+		pend = blockpipe(&old);
+		r = kcopy(Port_fd[in], Port_fd[out], n < 0? n: n - total);
+		unblockpipe(&old, pend);
+	}
+	else {
+		r = kcopy(Port_fd[in], Port_fd[out], n < 0? n: n - total);
+	}
+	if (-2 == r) error("copy-port: I/O error", UNDEF);
+	if (-1 == r) return total + bufcopy(in, out, n < 0? n: n - total);
+	return total + r;
 }
 
-cell b_symname(cell x) {
-	cell    n, k;
+cell copyfile(cell from, cell to) {
+	int		in, out, k;
+	long		r;
+	struct stat	st;
+	char		*b;
 
-	/*
-	 * Cannot pass name to mkstr(), because
-	 * symname(x) may move during GC.
-	*/
-	k = symlen(x);
-	n = mkstr(NULL, k-1);
-	Tag[n] |= CONST_TAG;
-	memcpy(string(n), symname(x), k);
-	return n;
+	from = unslice(from);
+	protect(from);
+	to = unslice(to);
+	unprot(1);
+	if (!stringp(from)) expect("copy-file", "string", from);
+	if (!stringp(to)) expect("copy-file", "string", to);
+	in = open((char *) string(from), O_RDONLY | O_CLOEXEC);
+	if (in < 0 || fstat(in, &st) < 0)
+		error("copy-file: cannot open", from);
+	out = open((char *) string(to),
+		O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st.st_mode & 0777);
+	if (out < 0) {
+		close(in);
+		error("copy-file: cannot create", to);
+	}
+	r = kcopy(in, out, -1);
+	if (-1 == r && (b = malloc(PORTBUFSIZE)) != NULL) {
+		r = 0;
+		while ((k = read(in, b, PORTBUFSIZE)) > 0) {
+			if (writeall(out, (byte *) b, k) < 0) {
+				r = -2;
+				break;
+			}
+			r += k;
+		}
+		if (k < 0) r = -2;
+		free(b);
+	}
+	close(in);
+	if (close(out) < 0) r = -2;
+	if (r < 0)
+		error("copy-file: I/O error", cons(from, cons(to, NIL)));
+	return mkfix(r);
 }
 
-cell liststr(cell x) {
-	cell	n, v;
-	int	k;
-	byte	*s;
+cell mkoffset(off_t k) {
+	if (k > CELL_MAX)
+		error("port position too large for a fixnum", UNDEF);
+	return mkfix(k);
+}
 
-	k = 0;
-	for (n = x; n != NIL; n = cdr(n))
-		k++;
-	v = mkstr(NULL, k);
-	s = string(v);
-	for (n = x; n != NIL; n = cdr(n)) {
-		if (atomp(n)) error("liststr: dotted list", x);
-		if (!charp(car(n))) expect("liststr", "char", car(n));
-		*s = charval(car(n));
-		s++;
-	}
-	return v;
+/*
+ * The position of a port is the position of the next char to
+ * be read or written, taking buffered chars into account.
+ */
+
+cell portpos(int p) {
+	off_t	k;
+
+	if (Port_str[p] != NIL) return mkfix(Port_ptr[p]);
+	if (Port_flags[p] & PMAP_TAG) return mkfix(Port_pos[p]);
+	k = lseek(Port_fd[p], 0, SEEK_CUR);
+	if (k < 0) return NIL;
+	if (Port_flags[p] & POUT_TAG)
+		return mkoffset(k + Port_lim[p]);
+	return mkoffset(k - (Port_lim[p] - Port_pos[p]));
 }
 
-cell listvec(cell x, int veclit) {
-	cell	n, v;
-	int	k;
-	cell	*p;
-	char	*msg;
+cell portseek(cell x, int p, cell n, int op) {
+	off_t	k;
 
-	msg = veclit? "vector literal contains a dot":
-		      "listvec: dotted list";
-	k = 0;
-	for (n = x; n != NIL; n = cdr(n))
-		k++;
-	if (0 == k) return Nullvec;
-	v = mkvec(k);
-	if (veclit) tag(v) |= CONST_TAG;
-	p = vector(v);
-	for (n = x; n != NIL; n = cdr(n)) {
-		if (atomp(n)) error(msg, x);
-		*p = car(n);
-		p++;
+	if (!fixp(n)) expect("seek", "fixnum", n);
+	if (Port_str[p] != NIL) error("seek: not a file port", x);
+	k = fixval(n);
+	Port_flags[p] &= ~PEOF_TAG;
+	if (Port_flags[p] & PMAP_TAG) {
+		if (POP_SEEKCUR == op) k += Port_pos[p];
+		if (POP_SEEKEND == op) k += Port_lim[p];
+		if (k < 0 || k > Port_lim[p])
+			error("seek: invalid position", n);
+		Port_pos[p] = k;
+		return mkfix(k);
 	}
-	return v;
+	if (Port_flags[p] & POUT_TAG) {
+		if (flushport(p) < 0)
+			error("file write error, port", x);
+	}
+	else if (POP_SEEKCUR == op) {
+		k -= Port_lim[p] - Port_pos[p];
+	}
+	k = lseek(Port_fd[p], k, POP_SEEK == op? SEEK_SET:
+				 POP_SEEKCUR == op? SEEK_CUR: SEEK_END);
+	if (k < 0) error("seek: cannot seek", x);
+	if (!(Port_flags[p] & POUT_TAG))
+		Port_pos[p] = Port_lim[p] = 0;
+	return mkoffset(k);
 }
 
-cell strlist(cell x) {
-	cell	a, new;
-	int	k, i;
+/*
+ * Positioned read, does not change the position of the port.
+ */
 
-	k = stringlen(x)-1;
-	if (0 == k) return NIL;
-	protect(a = cons(NIL, NIL));
-	for (i=0; i<k; i++) {
-		new = mkchar(string(x)[i]);
-		car(a) = new;
-		if (i < k-1) {
-			new = cons(NIL, NIL);
-			cdr(a) = new;
-			a = cdr(a);
+cell portpread(cell y, int p, cell off, cell x) {
+	cell	n, m;
+	off_t	o;
+	int	i, k, r;
+
+	if (!fixp(off)) expect("pread", "fixnum", off);
+	if (!fixp(x)) expect("pread", "fixnum", x);
+	if (fixval(off) < 0) error("pread: invalid position", off);
+	if (fixval(x) < 0 || fixval(x) > INT_MAX)
+		error("pread: invalid size", x);
+	o = fixval(off);
+	k = fixval(x);
+	if (0 == k) return Nullstr;
+	if (Port_flags[p] & PMAP_TAG) {
+		if (o >= Port_lim[p]) return EOFMARK;
+		if (k > Port_lim[p] - o) k = Port_lim[p] - o;
+		return mkstr((char *) &Port_buf[p][o], k);
+	}
+	n = mkstr(NULL, k);
+	for (i=0; i<k; i += r) {
+		r = pread(Port_fd[p], &string(n)[i], k-i, o+i);
+		if (r < 0 && EINTR == errno) {
+			r = 0;
+			continue;
 		}
+		if (r < 0) error("pread: cannot read", y);
+		if (0 == r) break;
 	}
-	return unprot(1);
+	if (0 == i) return EOFMARK;
+	if (i < k) {
+		protect(n);
+		m = mkstr(NULL, i);
+		memcpy(string(m), string(n), i);
+		unprot(1);
+		n = m;
+	}
+	return n;
 }
 
-cell veclist(cell x) {
-	cell	a, new;
-	int	k, i;
+/*
+ * Sockets and event loop
+ */
 
-	k = veclen(x);
-	if (0 == k) return NIL;
-	protect(a = cons(NIL, NIL));
-	for (i=0; i<k; i++) {
-		car(a) = vector(x)[i];
-		if (i < k-1) {
-			new = cons(NIL, NIL);
-			cdr(a) = new;
-			a = cdr(a);
+cell	S_unix, S_tcp;
+
+/*
+ * Create a Unix-domain or loopback TCP socket and connect it
+ * to ADDR or, if SRV is set, make it listen on ADDR.
+ */
+
+int mksocket(char *who, cell type, cell addr, int srv) {
+	struct sockaddr_un	su;
+	struct sockaddr_in	si;
+	struct sockaddr		*sa;
+	socklen_t		k;
+	int			s, one = 1;
+
+	if (S_unix == type) {
+		addr = unslice(addr);
+		if (!stringp(addr)) expect(who, "string", addr);
+		if (strsize(addr) >= sizeof(su.sun_path))
+			error("socket path too long", addr);
+		memset(&su, 0, sizeof(su));
+		su.sun_family = AF_UNIX;
+		strcpy(su.sun_path, (char *) string(addr));
+		sa = (struct sockaddr *) &su;
+		k = sizeof(su);
+	}
+	else if (S_tcp == type) {
+		if (	!fixp(addr) ||
+			fixval(addr) < 0 ||
+			fixval(addr) > 65535
+		)
+			expect(who, "TCP port number", addr);
+		memset(&si, 0, sizeof(si));
+		si.sin_family = AF_INET;
+		si.sin_port = htons((unsigned short) fixval(addr));
+		si.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		sa = (struct sockaddr *) &si;
+		k = sizeof(si);
+	}
+	else {
+		error("invalid socket type", type);
+		return -1;
+	}
+	if ((s = cloexec(socket(sa->sa_family, SOCK_STREAM, 0))) < 0)
+		return -1;
+	if (srv) {
+		if (S_tcp == type)
+			setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one,
+				sizeof(one));
+		if (bind(s, sa, k) < 0 || listen(s, SOMAXCONN) < 0) {
+			close(s);
+			return -1;
 		}
+		return s;
 	}
-	return unprot(1);
+	while (connect(s, sa, k) < 0) {
+		if (EINTR == errno) continue;
+		close(s);
+		return -1;
+	}
+	return s;
 }
 
-cell numstr(cell x, int r) {
-	char	*p;
-
-	if (r < 2 || r > 36)
-		error("numstr: bad radix", mkfix(r));
-	p = ntoa(fixval(x), r);
-	return mkstr(p, strlen(p));
-}
+/*
+ * Make a pair of an input port reading from IFD and an output
+ * port writing to OFD.
+ */
 
-cell strnum(char *s, int r) {
-	cell	n;
+cell fdports(char *msg, int ifd, int ofd, int oflags) {
+	int	in, out;
+	cell	n, x;
 
-	if (r < 2 || r > 36)
-		error("strnum: bad radix", mkfix(r));
-	n = scanfix(s, r, 0);
-	if (NIL == n && 10 == r)
-		n = scanfloat(s);
+	out = open_fdport(ofd, POUT_TAG | oflags);
+	in = open_fdport(ifd, 0);
+	if (in < 0 || out < 0) {
+		if (in >= 0) close_port(in);
+		if (out >= 0) close_port(out);
+		error(msg, UNDEF);
+	}
+	lock_port(in);
+	lock_port(out);
+	n = mkport(in, T_INPORT);
+	protect(n);
+	x = mkport(out, T_OUTPORT);
+	n = cons(n, x);
+	unprot(1);
+	unlock_port(in);
+	unlock_port(out);
 	return n;
 }
 
 /*
- * Inline functions, LOAD
+ * A connected socket is delivered as a pair of an input port
+ * and an output port. The output port has a descriptor of its
+ * own, so each port can be closed independently. Closing the
+ * output port shuts down the sending side of the socket.
  */
 
-void	begin_rec(void);
-void	end_rec(void);
+cell sockports(char *msg, int s) {
+	return fdports(msg, s, cloexec(dup(s)), PSOCK_TAG);
+}
 
-void loadfile(char *s) {
-	int	ldport, rdport, oline;
-	cell	x;
+cell opensocket(cell type, cell addr) {
+	int	s;
 
-	ldport = open_inport(s);
-	if (ldport < 0)
-		error("load: cannot open file",
-			mkstr(s, strlen(s)));
-	lock_port(ldport);
-	rdport = Inport;
-	oline = Line;
-	Files = cons(mkstr(s, strlen(s)), Files);
-	Line = 1;
-	begin_rec();
-	for (;;) {
-		set_inport(ldport);
-		x = xread();
-		set_inport(rdport);
-		if (EOFMARK == x) break;
-		eval(x, 0);
-	}
-	end_rec();
-	Files = cdr(Files);
-	Line = oline;
-	close_port(ldport);
+	s = mksocket("open-socket", type, addr, 0);
+	if (s < 0) error("open-socket: cannot connect", addr);
+	return sockports("open-socket: out of ports", s);
 }
 
-void load(cell x) {
-	char	path[TOKLEN+1];
+cell listensocket(cell type, cell addr) {
+	int	s, p;
 
-	if (!stringp(x))
-		expect("load", "string", x);
-	if (stringlen(x) > TOKLEN)
-		error("load: path too long", x);
-	strcpy(path, (char *) string(x));
-	loadfile(path);
+	s = mksocket("listen-socket", type, addr, 1);
+	if (s < 0) error("listen-socket: cannot listen", addr);
+	p = open_fdport(s, 0);
+	if (p < 0) error("listen-socket: out of ports", UNDEF);
+	return mkport(p, T_INPORT);
 }
 
-/*
- * Heap image I/O
- */
+cell acceptsocket(cell x, int p) {
+	int	s;
 
-struct imghdr {
-	char	magic[5];		/* "LISP9"	*/
+	while ((s = cloexec(accept(Port_fd[p], NULL, NULL))) < 0) {
+		if (EINTR == errno) continue;
+		if (wouldblock()) {
+			Port_flags[p] |= PAGAIN_TAG;
+			return NIL;
+		}
+		error("accept-socket: cannot accept", x);
+	}
+	Port_flags[p] &= ~PAGAIN_TAG;
+	return sockports("accept-socket: out of ports", s);
+}
+
+cell setblocking(cell x, int p, cell f) {
+	int	k;
+
+	k = fcntl(Port_fd[p], F_GETFL);
+	if (k >= 0)
+		k = fcntl(Port_fd[p], F_SETFL,
+			NIL == f? k | O_NONBLOCK: k & ~O_NONBLOCK);
+	if (k < 0) error("set-blocking: cannot change mode", x);
+	return x;
+}
+
+#define MAXEVENTS	64
+
+#define pending(p) \
+	(!(Port_flags[p] & POUT_TAG) && Port_pos[p] < Port_lim[p])
+
+/*
+ * Wait up to MS milliseconds (forever, if MS is negative) for
+ * any watched port to become ready and return a list of the
+ * ready ports. Input ports with buffered chars are always ready.
+ * Return T, if no ports are being watched.
+ */
+
+cell wait_events(cell ms) {
+	cell	n, a, x;
+	int	i, k, p, t;
+#ifdef __linux__
+	struct epoll_event	ev[MAXEVENTS];
+#else
+	struct pollfd		*pf;
+#endif
+
+	if (!fixp(ms)) expect("wait-events", "fixnum", ms);
+	if (0 == Nwatched) return TRUE;
+	t = fixval(ms) < 0? -1: fixval(ms) > INT_MAX? INT_MAX:
+		(int) fixval(ms);
+	for (i=0; i<Nports; i++)
+		if (Port_cb[i] != NIL && pending(i))
+			t = 0;
+#ifdef __linux__
+	k = epoll_wait(Epfd, ev, MAXEVENTS, t);
+#else
+	if ((pf = malloc(Nwatched * sizeof(struct pollfd))) == NULL)
+		error("wait-events: out of memory", UNDEF);
+	for (i = k = 0; i<Nports; i++) {
+		if (NIL == Port_cb[i]) continue;
+		pf[k].fd = Port_fd[i];
+		pf[k].events = Port_flags[i] & POUT_TAG? POLLOUT: POLLIN;
+		pf[k].revents = 0;
+		k++;
+	}
+	k = poll(pf, k, t);
+#endif
+	if (k < 0 && errno != EINTR)
+		error("wait-events: cannot wait", UNDEF);
+	n = cons(NIL, NIL);
+	protect(n);
+	a = n;
+#ifdef __linux__
+	for (i=0; i<k; i++) {
+		p = ev[i].data.fd;
+		if (NIL == Port_cb[p] || pending(p)) continue;
+#else
+	for (i = p = 0; k > 0 && p<Nports; p++) {
+		if (NIL == Port_cb[p]) continue;
+		if (0 == pf[i++].revents) continue;
+		if (pending(p)) continue;
+#endif
+		x = mkport(p, Port_flags[p] & POUT_TAG? T_OUTPORT:
+							T_INPORT);
+		x = cons(x, NIL);
+		cdr(a) = x;
+		a = x;
+	}
+#ifndef __linux__
+	free(pf);
+#endif
+	for (p=0; p<Nports; p++) {
+		if (NIL == Port_cb[p] || !pending(p)) continue;
+		x = mkport(p, T_INPORT);
+		x = cons(x, NIL);
+		cdr(a) = x;
+		a = x;
+	}
+	unprot(1);
+	return cdr(n);
+}
+
+/*
+ * Process ports
+ */
+
+extern char	**environ;
+
+/*
+ * Run CMD, which is either a shell command or a list of a
+ * program name and its arguments, with its standard input and
+ * output connected to pipes. Return a list of an input port
+ * reading the output of the process, an output port writing
+ * to its input, and its PID. The parent ends of the pipes are
+ * close-on-exec, so processes do not inherit each others pipes.
+ */
+
+cell spawnproc(cell cmd) {
+	char				*shv[4], **argv;
+	int				in[2], out[2], i, k, r;
+	pid_t				pid;
+	cell				a, n, x;
+	posix_spawn_file_actions_t	fa;
+	posix_spawnattr_t		sa;
+	sigset_t			ss;
+
+	cmd = unslice(cmd);
+	if (stringp(cmd)) {
+		protect(cmd);
+		k = 0;
+	}
+	else if (pairp(cmd)) {
+		n = cons(NIL, NIL);
+		protect(n);
+		a = n;
+		for (k=0; cmd != NIL; cmd = cdr(cmd), k++) {
+			if (!pairp(cmd))
+				expect("open-process", "list", cmd);
+			x = unslice(car(cmd));
+			if (!stringp(x))
+				expect("open-process", "string", car(cmd));
+			x = cons(x, NIL);
+			cdr(a) = x;
+			a = x;
+		}
+		cmd = cdr(n);
+	}
+	else {
+		expect("open-process", "string or list", cmd);
+	}
+	if (k) {
+		if ((argv = malloc((k+1) * sizeof(char *))) == NULL)
+			error("open-process: out of memory", UNDEF);
+		for (i=0, a = cmd; a != NIL; a = cdr(a), i++)
+			argv[i] = (char *) string(car(a));
+		argv[i] = NULL;
+	}
+	else {
+		shv[0] = "sh";
+		shv[1] = "-c";
+		shv[2] = (char *) string(cmd);
+		shv[3] = NULL;
+		argv = shv;
+	}
+	if (pipe(in) < 0) {
+		if (k) free(argv);
+		error("open-process: cannot create pipe", UNDEF);
+	}
+	if (pipe(out) < 0) {
+		close(in[0]);
+		close(in[1]);
+		if (k) free(argv);
+		error("open-process: cannot create pipe", UNDEF);
+	}
+	fcntl(in[1], F_SETFD, FD_CLOEXEC);
+	fcntl(out[0], F_SETFD, FD_CLOEXEC);
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_adddup2(&fa, in[0], 0);
+	posix_spawn_file_actions_adddup2(&fa, out[1], 1);
+	posix_spawn_file_actions_addclose(&fa, in[0]);
+	posix_spawn_file_actions_addclose(&fa, out[1]);
+	posix_spawnattr_init(&sa);
+	sigemptyset(&ss);
+	sigaddset(&ss, SIGPIPE);
+	posix_spawnattr_setsigdefault(&sa, &ss);
+	posix_spawnattr_setflags(&sa, POSIX_SPAWN_SETSIGDEF);
+	flushport(1);
+	flushport(2);
+	r = k?	posix_spawnp(&pid, argv[0], &fa, &sa, argv, environ):
+		posix_spawn(&pid, "/bin/sh", &fa, &sa, argv, environ);
+	posix_spawn_file_actions_destroy(&fa);
+	posix_spawnattr_destroy(&sa);
+	close(in[0]);
+	close(out[1]);
+	if (k) free(argv);
+	unprot(1);
+	if (r != 0) {
+		close(in[1]);
+		close(out[0]);
+		error("open-process: cannot run", cmd);
+	}
+	n = fdports("open-process: out of ports", out[0], in[1], PPIPE_TAG);
+	protect(n);
+	x = mkfix(pid);
+	x = cons(x, NIL);
+	x = cons(cdr(n), x);
+	n = cons(car(n), x);
+	unprot(1);
+	return n;
+}
+
+/*
+ * Return the exit status of process PID, waiting for it to
+ * terminate, if WAIT is set. Otherwise return NIL, if it is
+ * still running. A process that was terminated by a signal
+ * has a status of 128 plus the signal number.
+ */
+
+cell waitproc(cell pid, int wait) {
+	int	st;
+	pid_t	r;
+
+	if (!fixp(pid)) expect("process-wait", "fixnum", pid);
+	while ((r = waitpid(fixval(pid), &st, wait? 0: WNOHANG)) < 0) {
+		if (EINTR == errno) continue;
+		error("process-wait: no such child process", pid);
+	}
+	if (0 == r) return NIL;
+	if (WIFSIGNALED(st)) return mkfix(128 + WTERMSIG(st));
+	return mkfix(WEXITSTATUS(st));
+}
+
+/*
+ * Fork a worker process that applies FUN to zero arguments and
+ * serializes its value to a pipe. Return a list of an input port
+ * reading from the pipe, NIL, and the PID of the worker, so that
+ * PROCESS-WAIT accepts it. The worker shares the heap with its
+ * parent copy-on-write, so it starts without copying anything.
+ * When FUN signals an error, the worker exits with status 1 and
+ * the pipe is empty.
+ */
+
+cell serialize(cell x, cell p);
+
+cell forkproc(cell fn) {
+	int	fd[2], in, out;
+	pid_t	pid;
+	cell	n, x;
+
+	if (!closurep(fn)) expect("pmap", "function", fn);
+	if (pipe(fd) < 0) error("pmap: cannot create pipe", UNDEF);
+	fcntl(fd[0], F_SETFD, FD_CLOEXEC);
+	flush_ports();
+	pid = fork();
+	if (pid < 0) {
+		close(fd[0]);
+		close(fd[1]);
+		error("pmap: cannot fork", UNDEF);
+	}
+	if (0 == pid) {
+		close(fd[0]);
+		signal(SIGINT, SIG_DFL);
+		if (setjmp(Restart) != 0) {
+			flush_ports();
+			_exit(EXIT_FAILURE);
+		}
+		bindset(S_errtag, NIL);
+		out = open_fdport(fd[1], POUT_TAG);
+		if (out < 0) _exit(EXIT_FAILURE);
+		lock_port(out);
+		n = cons(fn, NIL);
+		n = eval(n, 1);
+		serialize(n, mkport(out, T_OUTPORT));
+		flush_ports();
+		_exit(EXIT_SUCCESS);
+	}
+	close(fd[1]);
+	if ((in = open_fdport(fd[0], 0)) < 0)
+		error("pmap: out of ports", UNDEF);
+	lock_port(in);
+	x = mkfix(pid);
+	x = cons(x, NIL);
+	x = cons(NIL, x);
+	protect(x);
+	n = mkport(in, T_INPORT);
+	n = cons(n, unprot(1));
+	unlock_port(in);
+	return n;
+}
+
+cell portop(cell o, cell x, cell y) {
+	int	op, p;
+	cell	n;
+
+	if (!fixp(o)) expect("portop", "fixnum", o);
+	op = (int) fixval(o);
+	switch (op) {
+	case POP_READ:
+		if (!inportp(y)) expect("read-bytes", "inport", y);
+		return readblock(x, portno(y), T_U8);
+	case POP_WRITE:
+		if (!outportp(y)) expect("write-bytes", "outport", y);
+		if (anystrp(x))
+			writeport(portno(y), (char *) strdata(x),
+				strsize(x));
+		else if (arrayp(x))
+			writeport(portno(y), (char *) string(x),
+				stringlen(x));
+		else
+			expect("write-bytes", "string or array", x);
+		return x;
+	case POP_POS:
+		if (!inportp(x) && !outportp(x))
+			expect("port-position", "port", x);
+		if (Port_fd[portno(x)] < 0 && NIL == Port_str[portno(x)])
+			error("port-position: port is not open", x);
+		return portpos(portno(x));
+	case POP_SEEK:
+	case POP_SEEKCUR:
+	case POP_SEEKEND:
+		if (!inportp(x) && !outportp(x)) expect("seek", "port", x);
+		if (Port_fd[portno(x)] < 0 && NIL == Port_str[portno(x)])
+			error("seek: port is not open", x);
+		return portseek(x, portno(x), y, op);
+	case POP_PREAD:
+		if (!inportp(x)) expect("pread", "inport", x);
+		if (Port_fd[portno(x)] < 0)
+			error("pread: port is not open", x);
+		if (!pairp(y)) expect("pread", "pair", y);
+		return portpread(x, portno(x), car(y), cdr(y));
+	case POP_COPY:
+		if (!inportp(x)) expect("copy-port", "inport", x);
+		if (!pairp(y) || !outportp(car(y)))
+			expect("copy-port", "outport", pairp(y)? car(y): y);
+		n = cdr(y);
+		if (n != NIL && (!fixp(n) || fixval(n) < 0))
+			expect("copy-port", "non-negative fixnum", n);
+		p = portno(x);
+		if (Port_fd[p] < 0) error("copy-port: port is not open", x);
+		return mkfix(copyport(p, portno(car(y)),
+			NIL == n? -1: (long) fixval(n)));
+	case POP_COPYFILE:
+		return copyfile(x, y);
+	case POP_BLOCKING:
+		if (!inportp(x) && !outportp(x))
+			expect("set-blocking", "port", x);
+		if (Port_fd[portno(x)] < 0)
+			error("set-blocking: not a file port", x);
+		return setblocking(x, portno(x), y);
+	case POP_WATCH:
+		if (!inportp(x) && !outportp(x)) expect("watch", "port", x);
+		p = portno(x);
+		if (Port_fd[p] < 0) error("watch: not a file port", x);
+		if (NIL == y)
+			unwatch_port(p);
+		else if (watch_port(p, y) < 0)
+			error("watch: cannot watch port", x);
+		return x;
+	case POP_WATCHER:
+		if (!inportp(x) && !outportp(x))
+			expect("watcher", "port", x);
+		return Port_cb[portno(x)];
+	case POP_WAIT:
+		return wait_events(x);
+	case POP_CONNECT:
+		return opensocket(x, y);
+	case POP_LISTEN:
+		return listensocket(x, y);
+	case POP_ACCEPT:
+		if (!inportp(x)) expect("accept-socket", "inport", x);
+		if (Port_fd[portno(x)] < 0)
+			error("accept-socket: port is not open", x);
+		return acceptsocket(x, portno(x));
+	case POP_SPAWN:
+		return spawnproc(x);
+	case POP_WAITPID:
+		return waitproc(x, y != NIL);
+	case POP_FORK:
+		return forkproc(x);
+	case POP_NCPUS:
+		return mkfix(sysconf(_SC_NPROCESSORS_ONLN) > 1?
+			sysconf(_SC_NPROCESSORS_ONLN): 1);
+	default:
+		error("portop: invalid opcode", o);
+		return UNDEF;
+	}
+}
+
+/*
+ * Inline functions, serialization
+ *
+ * Serialized data begins with a header consisting of the magic
+ * string "LS9S", a format version, the size of a cell, and the
+ * byte order probe also used in images. The header is followed
+ * by a single object in the format below, where N is an unsigned
+ * number of variable length (seven bits per byte, least
+ * significant group first, high bit set in all but the last
+ * byte):
+ *
+ *	NIL | TRUE | EOF
+ *	FIX8 byte | FIX cell | CHAR byte | FLOAT double
+ *	STRING N chars | SYMBOL N chars | VECTOR N objects
+ *	ARRAY type N bytes | PAIR car cdr | REF N
+ *
+ * Floats, strings, symbols, vectors, arrays, and pairs are
+ * numbered in the order in which they appear. REF N refers to
+ * the N'th object, so shared structure and cycles survive.
+ * Slices are serialized as fresh strings or vectors.
+ */
+
+#define SR_NIL		0
+#define SR_TRUE		1
+#define SR_EOF		2
+#define SR_FIX8		3
+#define SR_FIX		4
+#define SR_CHAR		5
+#define SR_FLOAT	6
+#define SR_STRING	7
+#define SR_SYMBOL	8
+#define SR_VECTOR	9
+#define SR_ARRAY	10
+#define SR_PAIR		11
+#define SR_REF		12
+
+#define SRMAGIC		"LS9S"
+#define SRVERSION	'1'
+#define SRHDRSIZE	10
+
+/*
+ * The object numbers of the serializer are kept in an open
+ * addressing hash table mapping nodes to numbers. The table
+ * and the output buffer are allocated with malloc(), so the
+ * serializer never allocates nodes and never triggers a GC.
+ */
+
+THREAD byte	*Srbuf = NULL;
+THREAD int	Srlen = 0,
+		Srsize = 0;
+
+THREAD cell	*Srkeys = NULL,
+		*Srvals = NULL;
+THREAD cell	Srslots = 0,
+		Srcount = 0;
+
+void srfree(void) {
+	free(Srkeys);
+	free(Srvals);
+	Srkeys = Srvals = NULL;
+	Srslots = 0;
+	if (Srsize > PORTBUFSIZE) {
+		free(Srbuf);
+		Srbuf = NULL;
+		Srsize = 0;
+	}
+}
+
+void srfail(char *msg, cell x) {
+	srfree();
+	error(msg, x);
+}
+
+void srput(void *s, int k) {
+	byte	*b;
+	int	m;
+
+	if (Srlen + k > Srsize) {
+		m = Srsize? Srsize: 4096;
+		while (Srlen + k > m) {
+			if (m > INT_MAX/2) srfail("serialize: too big", UNDEF);
+			m *= 2;
+		}
+		if ((b = realloc(Srbuf, m)) == NULL)
+			srfail("serialize: out of memory", UNDEF);
+		Srbuf = b;
+		Srsize = m;
+	}
+	memcpy(&Srbuf[Srlen], s, k);
+	Srlen += k;
+}
+
+void srbyte(int c) {
+	byte	b = c;
+
+	if (Srlen < Srsize)
+		Srbuf[Srlen++] = b;
+	else
+		srput(&b, 1);
+}
+
+void srnum(ucell n) {
+	while (n > 0x7f) {
+		srbyte((n & 0x7f) | 0x80);
+		n >>= 7;
+	}
+	srbyte(n);
+}
+
+#define srhash(x, k) ((cell) (((ucell) (x) * 2654435761U) & ((k)-1)))
+
+cell srlookup(cell x) {
+	cell	i;
+
+	if (0 == Srslots) return NIL;
+	i = srhash(x, Srslots);
+	while (Srkeys[i] != NIL) {
+		if (Srkeys[i] == x) return Srvals[i];
+		i = (i+1) & (Srslots-1);
+	}
+	return NIL;
+}
+
+void sradd(cell x) {
+	cell	*k, *v, i, j, n;
+
+	if (2 * (Srcount+1) > Srslots) {
+		n = Srslots? Srslots * 2: 1024;
+		k = malloc(n * sizeof(cell));
+		v = malloc(n * sizeof(cell));
+		if (NULL == k || NULL == v) {
+			free(k);
+			free(v);
+			srfail("serialize: out of memory", UNDEF);
+		}
+		for (i=0; i<n; i++) k[i] = NIL;
+		for (i=0; i<Srslots; i++) {
+			if (NIL == Srkeys[i]) continue;
+			j = srhash(Srkeys[i], n);
+			while (k[j] != NIL) j = (j+1) & (n-1);
+			k[j] = Srkeys[i];
+			v[j] = Srvals[i];
+		}
+		free(Srkeys);
+		free(Srvals);
+		Srkeys = k;
+		Srvals = v;
+		Srslots = n;
+	}
+	i = srhash(x, Srslots);
+	while (Srkeys[i] != NIL) i = (i+1) & (Srslots-1);
+	Srkeys[i] = x;
+	Srvals[i] = Srcount++;
+}
+
+void srobj(cell x) {
+	cell	i, k, *v;
+	double	d;
+
+	for (;;) {
+		if (NIL == x) {
+			srbyte(SR_NIL);
+			return;
+		}
+		if (TRUE == x) {
+			srbyte(SR_TRUE);
+			return;
+		}
+		if (EOFMARK == x) {
+			srbyte(SR_EOF);
+			return;
+		}
+		if (specialp(x))
+			srfail("serialize: cannot serialize", x);
+		if (fixp(x)) {
+			k = fixval(x);
+			if (k >= -128 && k < 128) {
+				srbyte(SR_FIX8);
+				srbyte(k & 0xff);
+			}
+			else {
+				srbyte(SR_FIX);
+				srput(&k, sizeof(cell));
+			}
+			return;
+		}
+		if (charp(x)) {
+			srbyte(SR_CHAR);
+			srbyte(charval(x));
+			return;
+		}
+		if ((k = srlookup(x)) != NIL) {
+			srbyte(SR_REF);
+			srnum(k);
+			return;
+		}
+		if (floatp(x)) {
+			sradd(x);
+			srbyte(SR_FLOAT);
+			d = floatval(x);
+			srput(&d, sizeof(double));
+		}
+		else if (anystrp(x)) {
+			sradd(x);
+			srbyte(SR_STRING);
+			srnum(strsize(x));
+			srput(strdata(x), strsize(x));
+		}
+		else if (symbolp(x)) {
+			sradd(x);
+			srbyte(SR_SYMBOL);
+			srnum(symlen(x)-1);
+			srput(symname(x), symlen(x)-1);
+		}
+		else if (anyvecp(x)) {
+			sradd(x);
+			srbyte(SR_VECTOR);
+			k = vecitems(x);
+			srnum(k);
+			v = vecdata(x);
+			for (i=0; i<k; i++)
+				srobj(v[i]);
+		}
+		else if (arrayp(x)) {
+			sradd(x);
+			srbyte(SR_ARRAY);
+			srbyte(T_F64 == car(x)? 0: T_S32 == car(x)? 1: 2);
+			srnum(stringlen(x));
+			srput(string(x), stringlen(x));
+		}
+		else if (pairp(x)) {
+			sradd(x);
+			srbyte(SR_PAIR);
+			srobj(car(x));
+			x = cdr(x);
+			continue;
+		}
+		else {
+			srfail("serialize: cannot serialize", x);
+		}
+		return;
+	}
+}
+
+void srmain(cell x) {
+	uint	bo;
+
+	srfree();
+	Srlen = 0;
+	Srcount = 0;
+	srput(SRMAGIC, 4);
+	srbyte(SRVERSION);
+	srbyte(sizeof(cell)+'0');
+	bo = 0x31323334L;
+	srput(&bo, 4);
+	srobj(x);
+	free(Srkeys);
+	free(Srvals);
+	Srkeys = Srvals = NULL;
+	Srslots = 0;
+}
+
+/*
+ * Serialize X and pass ownership of the buffer to the caller,
+ * so the data can move between isolates without further copies.
+ */
+
+byte *srtake(cell x, int *k) {
+	byte	*b;
+
+	srmain(x);
+	b = Srbuf;
+	*k = Srlen;
+	Srbuf = NULL;
+	Srsize = Srlen = 0;
+	return b;
+}
+
+cell serialize(cell x, cell p) {
+	cell	n;
+
+	if (p != NIL && !outportp(p)) expect("serialize", "outport", p);
+	if (	p != NIL &&
+		Port_fd[portno(p)] < 0 &&
+		NIL == Port_str[portno(p)]
+	)
+		error("serialize: port is not open", p);
+	srmain(x);
+	if (NIL == p) {
+		n = mkstr((char *) Srbuf, Srlen);
+		srfree();
+		return n;
+	}
+	writeport(portno(p), (char *) Srbuf, Srlen);
+	srfree();
+	return x;
+}
+
+/*
+ * The deserializer reads from the string Dsstr, the malloc()ed
+ * buffer Dsbuf, or the port Dsport. Numbered objects are kept
+ * in Dsobj[]. They are reachable from the object under
+ * construction, because each object is linked to its parent as
+ * soon as it is complete and compound objects are protected
+ * while their members are being read.
+ */
+
+THREAD cell	Dsstr = NIL;
+THREAD byte	*Dsbuf = NULL;
+THREAD int	Dsport, Dspos, Dslim;
+THREAD cell	*Dsobj = NULL;
+THREAD cell	Dscount, Dssize;
+THREAD char	*Dstmp = NULL;
+THREAD int	Dstmpsize = 0;
+
+void dsfree(void) {
+	free(Dsobj);
+	Dsobj = NULL;
+	Dssize = 0;
+	Dsstr = NIL;
+	free(Dsbuf);
+	Dsbuf = NULL;
+}
+
+#define dsdata() (Dsbuf? Dsbuf: string(Dsstr))
+
+void dsfail(char *msg) {
+	dsfree();
+	error(msg, UNDEF);
+}
+
+int dsbyte(void) {
+	int	c;
+
+	if (Dsport < 0) {
+		if (Dspos >= Dslim) dsfail("deserialize: truncated data");
+		return dsdata()[Dspos++];
+	}
+	c = getport(Dsport);
+	if (EOF == c) dsfail("deserialize: truncated data");
+	return c;
+}
+
+void dsget(void *s, cell k) {
+	byte	*b = s;
+	int	i;
+
+	if (Dsport < 0) {
+		if (k > Dslim - Dspos) dsfail("deserialize: truncated data");
+		memcpy(b, &dsdata()[Dspos], k);
+		Dspos += k;
+		return;
+	}
+	while (k > 0) {
+		i = Port_lim[Dsport] - Port_pos[Dsport];
+		if (i <= 0) {
+			*b++ = dsbyte();
+			k--;
+			continue;
+		}
+		if (i > k) i = k;
+		memcpy(b, &Port_buf[Dsport][Port_pos[Dsport]], i);
+		Port_pos[Dsport] += i;
+		b += i;
+		k -= i;
+	}
+}
+
+cell dsnum(void) {
+	ucell	n;
+	int	c, s;
+
+	n = 0;
+	for (s = 0;; s += 7) {
+		c = dsbyte();
+		if (s >= (int) sizeof(cell) * 8)
+			dsfail("deserialize: invalid data");
+		n |= (ucell) (c & 0x7f) << s;
+		if (!(c & 0x80)) break;
+	}
+	if (n > CELL_MAX) dsfail("deserialize: invalid data");
+	return n;
+}
+
+cell dsadd(cell x) {
+	cell	*v, k;
+
+	if (Dscount >= Dssize) {
+		k = Dssize? Dssize * 2: 1024;
+		if ((v = realloc(Dsobj, k * sizeof(cell))) == NULL)
+			dsfail("deserialize: out of memory");
+		Dsobj = v;
+		Dssize = k;
+	}
+	Dsobj[Dscount++] = x;
+	return x;
+}
+
+cell dsobj(int c);
+
+/*
+ * Reject a length of K items of SIZE bytes each when the items
+ * cannot be in the remaining input or could never fit into the
+ * vector pool. Every item takes at least one byte of input.
+ */
+
+void dslen(cell k, cell size) {
+	if (Dsport < 0 && k > Dslim - Dspos)
+		dsfail("deserialize: invalid data");
+	if (k > NVCELLS / size * (cell) sizeof(cell))
+		dsfail("deserialize: invalid data");
+}
+
+cell dssym(cell k) {
+	char	*b;
+
+	if (k >= Dstmpsize) {
+		if ((b = realloc(Dstmp, k+1)) == NULL)
+			dsfail("deserialize: out of memory");
+		Dstmp = b;
+		Dstmpsize = k+1;
+	}
+	dsget(Dstmp, k);
+	Dstmp[k] = 0;
+	if (strlen(Dstmp) != k) dsfail("deserialize: invalid symbol");
+	return symref(Dstmp);
+}
+
+cell dspair(void) {
+	cell	n, a, x;
+	int	c;
+
+	n = dsadd(cons(NIL, NIL));
+	protect(n);
+	a = n;
+	for (;;) {
+		x = dsobj(dsbyte());
+		car(a) = x;
+		c = dsbyte();
+		if (c != SR_PAIR) {
+			x = dsobj(c);
+			cdr(a) = x;
+			break;
+		}
+		x = dsadd(cons(NIL, NIL));
+		cdr(a) = x;
+		a = x;
+	}
+	unprot(1);
+	return n;
+}
+
+cell dsobj(int c) {
+	cell	n, x, i, k;
+	double	d;
+	int	t;
+
+	switch (c) {
+	case SR_NIL:
+		return NIL;
+	case SR_TRUE:
+		return TRUE;
+	case SR_EOF:
+		return EOFMARK;
+	case SR_FIX8:
+		return mkfix((signed char) dsbyte());
+	case SR_FIX:
+		dsget(&k, sizeof(cell));
+		return mkfix(k);
+	case SR_CHAR:
+		return mkchar(dsbyte());
+	case SR_FLOAT:
+		dsget(&d, sizeof(double));
+		return dsadd(mkfloat(d));
+	case SR_STRING:
+		k = dsnum();
+		dslen(k, 1);
+		n = mkstr(NULL, k);
+		if (k) dsget(string(n), k);
+		return dsadd(n);
+	case SR_SYMBOL:
+		return dsadd(dssym(dsnum()));
+	case SR_VECTOR:
+		k = dsnum();
+		dslen(k, sizeof(cell));
+		n = dsadd(mkvec(k));
+		protect(n);
+		for (i=0; i<k; i++) {
+			x = dsobj(dsbyte());
+			vector(n)[i] = x;
+		}
+		unprot(1);
+		return n;
+	case SR_ARRAY:
+		t = dsbyte();
+		if (t > 2) dsfail("deserialize: invalid data");
+		t = 0 == t? T_F64: 1 == t? T_S32: T_U8;
+		k = dsnum();
+		dslen(k, 1);
+		if (k % elsize(t)) dsfail("deserialize: invalid data");
+		n = mkarray(t, k / elsize(t));
+		if (k) dsget(string(n), k);
+		return dsadd(n);
+	case SR_PAIR:
+		return dspair();
+	case SR_REF:
+		k = dsnum();
+		if (k >= Dscount) dsfail("deserialize: invalid reference");
+		return Dsobj[k];
+	default:
+		dsfail("deserialize: invalid data");
+		return UNDEF;
+	}
+}
+
+cell dsmain(void) {
+	byte	h[SRHDRSIZE];
+	uint	bo;
+
+	dsget(h, SRHDRSIZE);
+	if (memcmp(h, SRMAGIC, 4) || h[4] != SRVERSION)
+		dsfail("deserialize: not serialized data");
+	memcpy(&bo, &h[6], 4);
+	if (h[5] != sizeof(cell)+'0' || bo != 0x31323334L)
+		dsfail("deserialize: wrong cell size or byte order");
+	return dsobj(dsbyte());
+}
+
+/*
+ * Deserialize K bytes from B, taking ownership of B.
+ */
+
+cell dstake(byte *b, int k) {
+	cell	n;
+
+	dsfree();
+	Dscount = 0;
+	Dsport = -1;
+	Dsbuf = b;
+	Dspos = 0;
+	Dslim = k;
+	n = dsmain();
+	dsfree();
+	return n;
+}
+
+cell deserialize(cell x) {
+	int	c;
+	cell	n;
+
+	dsfree();
+	Dscount = 0;
+	if (inportp(x)) {
+		Dsport = portno(x);
+		if (Port_fd[Dsport] < 0)
+			error("deserialize: port is not open", x);
+		if (EOF == (c = getport(Dsport)))
+			return EOFMARK;
+		rejectport(Dsport, c);
+	}
+	else {
+		x = unslice(x);
+		if (!stringp(x))
+			expect("deserialize", "string or inport", x);
+		Dsport = -1;
+		Dsstr = x;
+		Dspos = 0;
+		Dslim = stringlen(x)-1;
+	}
+	protect(x);
+	n = dsmain();
+	unprot(1);
+	dsfree();
+	return n;
+}
+
+/*
+ * Inline functions, lists
+ */
+
+cell lconc(cell x) {
+	cell	p, q, n, m;
+	int	k;
+
+	if (NIL == cdr(x)) return car(x);
+	protect(n = cons(NIL, NIL));
+	k = 0;
+	for (p = x; cdr(p) != NIL; p = cdr(p)) {
+		if (NIL == car(p)) continue;
+		for (q = car(p); q != NIL; q = cdr(q)) {
+			if (!pairp(q))
+				expect("conc", "list", car(p));
+			if (k != 0) {
+				m = cons(NIL, NIL);
+				cdr(n) = m;
+				n = cdr(n);
+			}
+			car(n) = car(q);
+			k++;
+		}
+	}
+	m = unprot(1);
+	if (0 == k) return car(p);
+	cdr(n) = car(p);
+	return m;
+}
+
+cell nlconc(cell x) {
+	cell	p, q;
+
+	while (pairp(cdr(x)) && NIL == car(x)) x = cdr(x);
+	if (NIL == cdr(x)) return car(x);
+	for (p = x; cdr(p) != NIL; p = cdr(p)) {
+		if (NIL == car(p)) continue;
+		if (constp(car(p))) error("nconc: immutable", car(p));
+		for (q = car(p); cdr(q) != NIL; q = cdr(q)) {
+			if (!pairp(q))
+				expect("nconc", "list", car(p));
+		}
+		while (pairp(cdr(p)) && NIL == cadr(p))
+			p = cdr(p);
+		if (NIL == cdr(p)) break;
+		cdr(q) = cadr(p);
+	}
+	return car(x);
+}
+
+/*
+ * Inline functions, type conversion
+ */
+
+cell b_symbol(cell x) {
+	cell	y, n, k;
+
+	y = findsym((char *) string(x));
+	if (y != NIL) return y;
+	/*
+	 * Cannot pass content to mksym(), because
+	 * string(x) may move during GC.
+	 */
+	k = stringlen(x);
+	n = mksym("", k-1);
+	memcpy(symname(n), string(x), k);
+	return intern(n);
+}
+
+cell b_symname(cell x) {
+	cell    n, k;
+
+	/*
+	 * Cannot pass name to mkstr(), because
+	 * symname(x) may move during GC.
+	*/
+	k = symlen(x);
+	n = mkstr(NULL, k-1);
+	Tag[n] |= CONST_TAG;
+	memcpy(string(n), symname(x), k);
+	return n;
+}
+
+cell liststr(cell x) {
+	cell	n, v;
+	int	k;
+	byte	*s;
+
+	k = 0;
+	for (n = x; n != NIL; n = cdr(n))
+		k++;
+	v = mkstr(NULL, k);
+	s = string(v);
+	for (n = x; n != NIL; n = cdr(n)) {
+		if (atomp(n)) error("liststr: dotted list", x);
+		if (!charp(car(n))) expect("liststr", "char", car(n));
+		*s = charval(car(n));
+		s++;
+	}
+	return v;
+}
+
+cell listvec(cell x, int veclit) {
+	cell	n, v;
+	int	k;
+	cell	*p;
+	char	*msg;
+
+	msg = veclit? "vector literal contains a dot":
+		      "listvec: dotted list";
+	k = 0;
+	for (n = x; n != NIL; n = cdr(n))
+		k++;
+	if (0 == k) return Nullvec;
+	v = mkvec(k);
+	if (veclit) tag(v) |= CONST_TAG;
+	p = vector(v);
+	for (n = x; n != NIL; n = cdr(n)) {
+		if (atomp(n)) error(msg, x);
+		*p = car(n);
+		p++;
+	}
+	return v;
+}
+
+cell strlist(cell x) {
+	cell	a, new, k, i;
+
+	k = strsize(x);
+	if (0 == k) return NIL;
+	protect(a = cons(NIL, NIL));
+	for (i=0; i<k; i++) {
+		new = mkchar(strdata(x)[i]);
+		car(a) = new;
+		if (i < k-1) {
+			new = cons(NIL, NIL);
+			cdr(a) = new;
+			a = cdr(a);
+		}
+	}
+	return unprot(1);
+}
+
+cell veclist(cell x) {
+	cell	a, new;
+	int	k, i;
+
+	k = vecitems(x);
+	if (0 == k) return NIL;
+	protect(a = cons(NIL, NIL));
+	for (i=0; i<k; i++) {
+		car(a) = vecdata(x)[i];
+		if (i < k-1) {
+			new = cons(NIL, NIL);
+			cdr(a) = new;
+			a = cdr(a);
+		}
+	}
+	return unprot(1);
+}
+
+cell numstr(cell x, cell r) {
+	char	*p;
+
+	if (r < 2 || r > 36)
+		error("numstr: bad radix", mkfix(r));
+	p = ntoa(fixval(x), (int) r);
+	return mkstr(p, strlen(p));
+}
+
+cell strnum(char *s, cell r) {
+	cell	n;
+
+	if (r < 2 || r > 36)
+		error("strnum: bad radix", mkfix(r));
+	n = scanfix(s, (int) r, 0);
+	if (NIL == n && 10 == r)
+		n = scanfloat(s);
+	return n;
+}
+
+/*
+ * Inline functions, LOAD
+ */
+
+void	begin_rec(void);
+void	end_rec(void);
+cell	interpret(cell x);
+
+/*
+ * Compiled files
+ *
+ * A compiled file consists of a header followed by one serialized
+ * record per top-level form of its source file. Each record is a
+ * vector #(line code lits globs syms), where CODE is the bytecode
+ * of the form and LITS, GLOBS, and SYMS are lists of (pos . obj)
+ * pairs locating those operands of CODE that depend on the system
+ * that compiled it: literal pool slots (QUOTE), indices of global
+ * bindings (REF, SETREF, and CPREF outside of closure bodies), and
+ * symbol IDs (REF, MACRO). When loading a record, these operands
+ * are replaced by the slot, index, or ID of OBJ in the running
+ * system, so the form can be run without compiling it again.
+ */
+
+#define L9CMAGIC	"LS9C"
+
+THREAD cell	*Gnames = NULL;
+THREAD int	Gnlen = 0;
+THREAD int	*Clsends = NULL;
+THREAD int	Celen = 0;
+
+void l9cpath(char *path, char *s) {
+	int	k;
+
+	k = strlen(s);
+	strcpy(path, s);
+	if (k > 4 && 0 == strcmp(&s[k-4], ".ls9")) k -= 4;
+	strcpy(&path[k], ".l9c");
+}
+
+cell l9cheader(void) {
+	return mkstr(L9CMAGIC VERSION, strlen(L9CMAGIC VERSION));
+}
+
+void addreloc(cell r, int slot, int pos, cell x) {
+	cell	n;
+
+	n = cons(cons(mkfix(pos), x), vector(r)[slot]);
+	vector(r)[slot] = n;
+}
+
+cell mkrecord(cell prog) {
+	cell	n, r;
+	int	i, k, nc, op, ng;
+	byte	*v;
+	void	*p;
+
+	ng = length(Glob);
+	if (ng > Gnlen) {
+		p = realloc(Gnames, ng * sizeof(cell));
+		if (NULL == p) error("compile-file: out of memory", UNDEF);
+		Gnames = p;
+		Gnlen = ng;
+	}
+	for (i=0, n = Glob; n != NIL; n = cdr(n))
+		Gnames[i++] = caar(n);
+	k = stringlen(cdr(prog));
+	if (k > Celen) {
+		p = realloc(Clsends, k * sizeof(int));
+		if (NULL == p) error("compile-file: out of memory", UNDEF);
+		Clsends = p;
+		Celen = k;
+	}
+	r = mkvec(5);
+	protect(r);
+	n = mkfix(Line);
+	vector(r)[0] = n;
+	vector(r)[1] = cdr(prog);
+	nc = 0;
+	for (i=0; i<k; i += opsize(op)) {
+		v = string(cdr(prog));
+		op = v[i];
+		while (nc > 0 && i >= Clsends[nc-1])
+			nc--;
+		if (	OP_JMP == op && i+ISIZE1 < k &&
+			(OP_ENTER == v[i+ISIZE1] || OP_ENTCOL == v[i+ISIZE1])
+		) {
+			Clsends[nc++] = fetcharg(v, i+1);
+		}
+		else if (OP_QUOTE == op) {
+			addreloc(r, 2, i+1, vector(Obarray)[fetcharg(v, i+1)]);
+		}
+		else if (OP_MACRO == op) {
+			addreloc(r, 4, i+1, vector(Symbols)[fetcharg(v, i+1)]);
+		}
+		else if (OP_REF == op || OP_SETREF == op || OP_CPREF == op) {
+			if (0 == nc)
+				addreloc(r, 3, i+1, Gnames[fetcharg(v, i+1)]);
+			if (OP_REF == op) {
+				v = string(cdr(prog));
+				addreloc(r, 4, i+3,
+					vector(Symbols)[fetcharg(v, i+3)]);
+			}
+		}
+	}
+	return unprot(1);
+}
+
+void compilefile(char *s) {
+	int	ldport, rdport, oline;
+	char	path[TOKLEN+5];
+	cell	x, n;
+
+	ldport = open_inport(s);
+	if (ldport < 0)
+		error("compile-file: cannot open file",
+			mkstr(s, strlen(s)));
+	lock_port(ldport);
+	rdport = Inport;
+	oline = Line;
+	Files = cons(mkstr(s, strlen(s)), Files);
+	Line = 1;
+	begin_rec();
+	protect(n = NIL);
+	for (;;) {
+		set_inport(ldport);
+		x = xread();
+		set_inport(rdport);
+		if (EOFMARK == x) break;
+		protect(x);
+		x = expand(x, 1);  car(Protected) = x;
+		syncheck(x, 1);
+		x = clsconv(x);    car(Protected) = x;
+		x = compile(x);    car(Protected) = x;
+		n = mkrecord(x);
+		n = cons(n, cadr(Protected));
+		cadr(Protected) = n;
+		interpret(x);
+		unprot(1);
+	}
+	close_port(ldport);
+	car(Protected) = nreverse(car(Protected));
+	l9cpath(path, s);
+	ldport = open_outport(path, 0);
+	if (ldport < 0)
+		error("compile-file: cannot create file",
+			mkstr(path, strlen(path)));
+	x = mkport(ldport, T_OUTPORT);
+	protect(x);
+	serialize(l9cheader(), x);
+	for (n = cadr(Protected); n != NIL; n = cdr(n))
+		serialize(car(n), x);
+	close_port(ldport);
+	unprot(2);
+	end_rec();
+	Files = cdr(Files);
+	Line = oline;
+}
+
+void l9cpatch(cell code, int pos, int n) {
+	if (pos < 1 || pos+2 >= stringlen(code))
+		error("load: invalid compiled file", code);
+	if (n < 0 || n > 65535)
+		error("bytecode argument out of range", mkfix(n));
+	string(code)[pos] = n >> 8;
+	string(code)[pos+1] = n & 255;
+}
+
+int globindex(cell y) {
+	cell	n, b, last;
+	int	i;
+
+	last = NIL;
+	i = 0;
+	for (n = Glob; n != NIL; n = cdr(n)) {
+		if (caar(n) == y) return i;
+		last = n;
+		i++;
+	}
+	b = cons(y, cons(UNDEF, NIL));
+	b = cons(b, NIL);
+	if (NIL == last)
+		Glob = b;
+	else
+		cdr(last) = b;
+	return i;
+}
+
+cell relocate(cell r) {
+	cell	code, prog, n, y;
+	int	i, pos;
+
+	code = vector(r)[1];
+	for (n = vector(r)[2]; n != NIL; n = cdr(n))
+		l9cpatch(code, fixval(caar(n)), 0);
+	prog = mkatom(T_BYTECODE, code);
+	protect(prog);
+	for (n = vector(r)[2]; n != NIL; n = cdr(n)) {
+		i = obindex(cdar(n));
+		vector(Obarray)[i] = cdar(n);
+		l9cpatch(code, fixval(caar(n)), i);
+	}
+	if (NIL == Defined) Defined = carof(Glob);
+	for (n = vector(r)[3]; n != NIL; n = cdr(n)) {
+		y = cdar(n);
+		if (!symbolp(y)) error("load: invalid compiled file", y);
+		pos = fixval(caar(n));
+		l9cpatch(code, pos, globindex(y));
+		if (	OP_SETREF == string(code)[pos-1] &&
+			memq(y, Defined) == NIL
+		)
+			Defined = cons(y, Defined);
+	}
+	for (n = vector(r)[4]; n != NIL; n = cdr(n)) {
+		y = htlookup(Symhash, cdar(n));
+		if (UNDEF == y) error("load: invalid compiled file", cdar(n));
+		l9cpatch(code, fixval(caar(n)), fixval(cdr(y)));
+	}
+	return unprot(1);
+}
+
+int newerp(struct stat *a, struct stat *b) {
+	if (a->st_mtim.tv_sec != b->st_mtim.tv_sec)
+		return a->st_mtim.tv_sec > b->st_mtim.tv_sec;
+	return a->st_mtim.tv_nsec > b->st_mtim.tv_nsec;
+}
+
+int loadl9c(char *s) {
+	char		path[TOKLEN+5];
+	struct stat	ss, sc;
+	int		p, oline;
+	cell		x, r;
+
+	if (strlen(s) > TOKLEN) return 0;
+	l9cpath(path, s);
+	if (	stat(s, &ss) < 0 ||
+		stat(path, &sc) < 0 ||
+		!newerp(&sc, &ss)
+	)
+		return 0;
+	if ((p = open_inport(path)) < 0)
+		return 0;
+	x = mkport(p, T_INPORT);
+	protect(x);
+	r = deserialize(x);
+	if (!stringp(r) || strcmp((char *) string(r), L9CMAGIC VERSION)) {
+		close_port(p);
+		unprot(1);
+		return 0;
+	}
+	oline = Line;
+	Files = cons(mkstr(s, strlen(s)), Files);
+	begin_rec();
+	for (;;) {
+		r = deserialize(x);
+		if (EOFMARK == r) break;
+		if (	!vectorp(r) || veclen(r) != 5 ||
+			!fixp(vector(r)[0]) || !stringp(vector(r)[1])
+		)
+			error("load: invalid compiled file",
+				mkstr(path, strlen(path)));
+		protect(r);
+		Line = fixval(vector(r)[0]);
+		interpret(relocate(r));
+		unprot(1);
+	}
+	end_rec();
+	Files = cdr(Files);
+	Line = oline;
+	close_port(p);
+	unprot(1);
+	return 1;
+}
+
+void loadfile(char *s) {
+	int	ldport, rdport, oline;
+	cell	x;
+
+	if (loadl9c(s)) return;
+	ldport = open_inport(s);
+	if (ldport < 0)
+		error("load: cannot open file",
+			mkstr(s, strlen(s)));
+	lock_port(ldport);
+	rdport = Inport;
+	oline = Line;
+	Files = cons(mkstr(s, strlen(s)), Files);
+	Line = 1;
+	begin_rec();
+	for (;;) {
+		set_inport(ldport);
+		x = xread();
+		set_inport(rdport);
+		if (EOFMARK == x) break;
+		eval(x, 0);
+	}
+	end_rec();
+	Files = cdr(Files);
+	Line = oline;
+	close_port(ldport);
+}
+
+void load(cell x) {
+	char	path[TOKLEN+1];
+
+	x = unslice(x);
+	if (!stringp(x))
+		expect("load", "string", x);
+	if (stringlen(x) > TOKLEN)
+		error("load: path too long", x);
+	strcpy(path, (char *) string(x));
+	loadfile(path);
+}
+
+cell compfile(cell x) {
+	char	path[TOKLEN+1], out[TOKLEN+5];
+
+	x = unslice(x);
+	if (!stringp(x))
+		expect("compile-file", "string", x);
+	if (stringlen(x) > TOKLEN)
+		error("compile-file: path too long", x);
+	strcpy(path, (char *) string(x));
+	compilefile(path);
+	l9cpath(out, path);
+	return mkstr(out, strlen(out));
+}
+
+/*
+ * Heap image I/O
+ */
+
+struct imghdr {
+	char	magic[5];		/* "LISP9"	*/
 	char	version[8];		/* "yyyymmdd"	*/
 	char	cell_size[1];		/* size + '0'	*/
 	char	byte_order[4];		/* e.g. "4321"	*/
-	char	pad[14];
+	char	format[1];		/* IMGFORMAT	*/
+	char	pad[13];
 };
 
+/*
+ * An image contains the live nodes and vectors only. Before
+ * writing an image, the vector pool is compacted by GCV and the
+ * live nodes are renumbered densely from 0 to N-1, so an image
+ * can be loaded into pools of any size that can hold its data.
+ * Free nodes map to NIL.
+ *
+ * The node fields and vectors are stored in sections that begin
+ * at multiples of IMGALIGN, which is a multiple of all common page
+ * sizes, so that loadimg() can map them over the beginning of the
+ * pools instead of reading them. Mapped pools are private copies
+ * of the image file: their pages are read in when first accessed
+ * and shared with other processes using the same image until they
+ * are modified.
+ */
+
+#define IMGFORMAT	'3'
+#define IMGALIGN	65536L
+
+#define imgalign(x)	(((x) + IMGALIGN-1) & ~(IMGALIGN-1))
+
+THREAD cell	*Imgmap = NULL;
+
+#define reloc(x)	(specialp(x)? (x): Imgmap[x])
+
 char *xfwrite(void *buf, int siz, int n, FILE *f) {
 	if (fwrite(buf, siz, n, f) != n)
 		return "image file write error";
 	return NULL;
 }
 
-void saveimg(char *path) {
-	char	b[TOKLEN+1], *p;
+void saveimg(char *path) {
+	char	b[TOKLEN+1], *p;
+
+	if (strlen(path)+7 >= TOKLEN)
+		error("image path too long", UNDEF);
+	strcpy(b, path);
+	p = strrchr(b, '.');
+	if (NULL == p) p = b+strlen(b);
+	*p = 0;
+	strcat(b, ".oimage");
+	remove(b);
+	rename(path, b);
+}
+
+THREAD cell	*Imagevars[NROOTS];
+
+cell mkimgmap(void) {
+	cell	i, j;
+
+	Imgmap = malloc(NNODES * sizeof(cell));
+	if (NULL == Imgmap) return -1;
+	for (i=0; i<NNODES; i++)
+		Imgmap[i] = 0;
+	for (i = Freelist; i != NIL; i = cdr(i))
+		Imgmap[i] = NIL;
+	j = 0;
+	for (i=0; i<NNODES; i++)
+		if (Imgmap[i] != NIL)
+			Imgmap[i] = j++;
+	return j;
+}
+
+int dumpnodes(FILE *f, int sect) {
+	cell	i, n;
+
+	for (i=0; i<NNODES; i++) {
+		if (NIL == Imgmap[i])
+			continue;
+		if (2 == sect) {
+			if (fputc(tag(i), f) == EOF) return -1;
+			continue;
+		}
+		if (0 == sect)
+			n = tag(i) & (ATOM_TAG|VECTOR_TAG)? car(i): reloc(car(i));
+		else
+			n = tag(i) & VECTOR_TAG? cdr(i): reloc(cdr(i));
+		if (fwrite(&n, sizeof(cell), 1, f) != 1) return -1;
+	}
+	return 0;
+}
+
+int dumpvecs(FILE *f) {
+	cell	p, k, i, n, node;
+
+	for (p = 0; p < Freevec; p += k) {
+		node = Vectors[p + RAW_VECLINK];
+		k = vecsize(Vectors[p + RAW_VECSIZE]);
+		n = reloc(node);
+		if (	fwrite(&n, sizeof(cell), 1, f) != 1 ||
+			fwrite(&Vectors[p + RAW_VECSIZE], sizeof(cell), 1, f)
+			 != 1)
+			return -1;
+		for (i = RAW_VECDATA; i < k; i++) {
+			n = Vectors[p+i];
+			if (T_VECTOR == car(node)) n = reloc(n);
+			if (fwrite(&n, sizeof(cell), 1, f) != 1) return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Write an image header with the given FORMAT, followed by the
+ * number of NODES, the number of vector cells, and Symptr.
+ */
+
+char *dumphdr(FILE *f, int format, cell nodes) {
+	struct imghdr	m;
+	uint		bo;
+	char		*s;
+
+	memset(&m, '_', sizeof(m));
+	memcpy(m.magic, "LISP9", sizeof(m.magic));
+	memcpy(m.version, VERSION, sizeof(m.version));
+	m.cell_size[0] = sizeof(cell)+'0';
+	bo = 0x31323334L;
+	memcpy(m.byte_order, &bo, 4);
+	m.format[0] = format;
+	s = xfwrite(&m, sizeof(m), 1, f);
+	if (NULL == s) s = xfwrite(&nodes, sizeof(cell), 1, f);
+	if (NULL == s) s = xfwrite(&Freevec, sizeof(cell), 1, f);
+	if (NULL == s) s = xfwrite(&Symptr, sizeof(cell), 1, f);
+	return s;
+}
+
+char *dumpimgf(FILE *f, long base) {
+	cell		n, nodes, **v;
+	int		i;
+	long		off;
+	char		*s;
+
+	gcv();
+	if ((nodes = mkimgmap()) < 0)
+		return "out of memory";
+	s = dumphdr(f, IMGFORMAT, nodes);
+	v = Imagevars;
+	for (i = 0; NULL == s && v[i] != NULL; i++) {
+		n = reloc(*v[i]);
+		s = xfwrite(&n, sizeof(cell), 1, f);
+	}
+	off = ftell(f) - base;
+	for (i = 0; NULL == s && i < 4; i++) {
+		off = imgalign(off);
+		if (	fseek(f, base + off, SEEK_SET) < 0 ||
+			(i < 3 && dumpnodes(f, i) < 0) ||
+			(3 == i && dumpvecs(f) < 0)
+		)
+			s = "image dump failed";
+		off = i < 2? off + nodes * sizeof(cell):
+			2 == i? off + nodes:
+			off + Freevec * sizeof(cell);
+	}
+	free(Imgmap);
+	Imgmap = NULL;
+	if (	NULL == s &&
+		(fflush(f) != 0 ||
+		 ftruncate(fileno(f), base + imgalign(off)) < 0)
+	)
+		s = "image dump failed";
+	return s;
+}
+
+char	*shakeimgf(FILE *f, long base);
+
+char *dumpimg(char *path, int shake) {
+	FILE	*f;
+	char	*s, b[TOKLEN+1];
+
+	saveimg(path);
+	strcpy(b, path);
+	f = fopen(b, "wb");
+	if (NULL == f) return "cannot create image file";
+	s = shake? shakeimgf(f, 0): dumpimgf(f, 0);
+	if (fclose(f) != 0 && NULL == s)
+		s = "image dump failed";
+	return s;
+}
+
+char *xfdread(int fd, void *buf, int n) {
+	if (read(fd, buf, n) != n)
+		return "image file read error";
+	return NULL;
+}
+
+int mapsect(int fd, void *pool, long size, long off) {
+	long	pg;
+
+	if (0 == size) return 0;
+	pg = sysconf(_SC_PAGESIZE);
+	if (	pg > 0 && IMGALIGN % pg == 0 &&
+		mmap(pool, (size + pg-1) / pg * pg, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_FIXED, fd, off) != MAP_FAILED
+	)
+		return 0;
+	return pread(fd, pool, size, off) == size? 0: -1;
+}
+
+char *ckimghdr(struct imghdr *m, int format) {
+	uint	bo;
+
+	if (memcmp(m->magic, "LISP9", sizeof(m->magic)))
+		return "imghdr match failed";
+	if (memcmp(m->version, VERSION, sizeof(m->version)))
+		return "wrong image version";
+	if (m->cell_size[0]-'0' != sizeof(cell))
+		return "wrong cell size";
+	memcpy(&bo, m->byte_order, 4);
+	if (bo != 0x31323334L)
+		return "wrong byte order";
+	if (m->format[0] != format)
+		return "wrong image format";
+	return NULL;
+}
+
+/*
+ * The sections of the last image loaded, see "Delta images".
+ * Isolates do not inherit them, so they have no base image.
+ */
+
+THREAD long	Basesect[4];
+THREAD cell	Basenodes, Basevcells;
+
+/*
+ * Load the image of SIZE bytes at offset BASE of the file FD.
+ */
+
+char *loadimgfd(int fd, long base, long size) {
+	cell		**v;
+	int		i;
+	long		off, end, sect[4];
+	struct imghdr	m;
+	cell		nodes, vcells, symptr;
+	char		*s;
+
+	if (lseek(fd, base, SEEK_SET) < 0)
+		return "image file read error";
+	if ((s = xfdread(fd, &m, sizeof(m))) != NULL)
+		return s;
+	if ((s = ckimghdr(&m, IMGFORMAT)) != NULL)
+		return s;
+	if (	(s = xfdread(fd, &nodes, sizeof(cell))) != NULL ||
+		(s = xfdread(fd, &vcells, sizeof(cell))) != NULL ||
+		(s = xfdread(fd, &symptr, sizeof(cell))) != NULL)
+	{
+		return s;
+	}
+	if (nodes < 0 || nodes > NNODES)
+		return "node pool too small for image";
+	if (vcells < 0 || vcells > NVCELLS)
+		return "vector pool too small for image";
+	v = Imagevars;
+	for (i=0; v[i] != NULL; i++) {
+		if ((s = xfdread(fd, v[i], sizeof(cell))) != NULL)
+			return s;
+	}
+	off = imgalign(lseek(fd, 0, SEEK_CUR) - base);
+	sect[0] = off;
+	sect[1] = imgalign(sect[0] + nodes * sizeof(cell));
+	sect[2] = imgalign(sect[1] + nodes * sizeof(cell));
+	sect[3] = imgalign(sect[2] + nodes);
+	end = sect[3] + vcells * sizeof(cell);
+	if (size != imgalign(end))
+		return "wrong file size";
+	if (	mapsect(fd, Car, nodes * sizeof(cell), base + sect[0]) < 0 ||
+		mapsect(fd, Cdr, nodes * sizeof(cell), base + sect[1]) < 0 ||
+		mapsect(fd, Tag, nodes, base + sect[2]) < 0 ||
+		mapsect(fd, Vectors, vcells * sizeof(cell), base + sect[3]) < 0)
+	{
+		return "image file read error";
+	}
+	Freelist = NIL;
+	Freenode = nodes;
+	Freevec = vcells;
+	Symptr = symptr;
+	for (i=0; i<4; i++)
+		Basesect[i] = base + sect[i];
+	Basenodes = nodes;
+	Basevcells = vcells;
+	return NULL;
+}
+
+/*
+ * Delta images
+ *
+ * A delta image records the differences between the current state
+ * of the pools and the image file that LISP9 restarted, which is
+ * called the base image. After loading an image, node I of the
+ * node pool and cell I of the vector pool are in the same place as
+ * in the image file (or zero, beyond its end), so a delta image
+ * can be stored in terms of pool offsets instead of relocating its
+ * data.
+ *
+ * The pools are compared with the base image in chunks of DCHUNK
+ * nodes or vector cells. Node chunks differ when any node that is
+ * not on the free list differs, so recycling free nodes does not
+ * make a chunk dirty. Only chunks that differ are written, but all
+ * of them are compared, because stores to the pools are not
+ * tracked and the GC writes to every live node anyway. Each delta
+ * is relative to the base image, so checkpoints do not form chains,
+ * and a delta image can be restarted as long as its base image has
+ * not changed.
+ *
+ * A delta image consists of a header with format DELTAFORMAT, the
+ * node extent, the number of vector cells, Symptr, the size and
+ * modification time of the base image, the Imagevars, the length
+ * and absolute path of the base image, and the chunks. Each chunk
+ * starts with its kind (0 = nodes, 1 = vectors) and number and is
+ * followed by its cars, cdrs, and tags, or by its vector cells. A
+ * kind of -1 ends the image.
+ */
+
+#define DELTAFORMAT	'D'
+#define DCHUNK		1024
+
+THREAD char	*Basepath = NULL;
+THREAD long	Basesize, Basemtime;
+
+char *loaddelta(int fd);
+
+void setbase(char *path, struct stat *st) {
+	free(Basepath);
+	Basepath = realpath(path, NULL);
+	if (NULL == Basepath) Basepath = strdup(path);
+	Basesize = st->st_size;
+	Basemtime = st->st_mtime;
+}
+
+char *loadimg(char *path) {
+	int		fd;
+	struct stat	st;
+	struct imghdr	m;
+	char		*s;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return "could not open file";
+	if (fstat(fd, &st) < 0 || pread(fd, &m, sizeof(m), 0) != sizeof(m))
+		s = "image file read error";
+	else if (DELTAFORMAT == m.format[0])
+		s = loaddelta(fd);
+	else if ((s = loadimgfd(fd, 0, st.st_size)) == NULL)
+		setbase(path, &st);
+	close(fd);
+	return s;
+}
+
+/*
+ * Read LEN bytes at offset OFF of the base image FD into BUF,
+ * where the section at OFF has AVAIL bytes left. Beyond the end
+ * of the section, fill BUF with zeros.
+ */
+
+int baseread(int fd, void *buf, long len, long off, long avail) {
+	long	k;
+
+	k = avail < 0? 0: avail < len? avail: len;
+	memset((char *) buf + k, 0, len - k);
+	return 0 == k || pread(fd, buf, k, off) == k? 0: -1;
+}
+
+char *dumpchunks(FILE *f, int fd, byte *fmap) {
+	cell	bcar[DCHUNK], bcdr[DCHUNK], c, i, j, k, n, kind;
+	byte	btag[DCHUNK];
+
+	for (c = 0; c < Freenode; c += DCHUNK) {
+		n = Freenode - c < DCHUNK? Freenode - c: DCHUNK;
+		k = Basenodes - c;
+		if (	baseread(fd, bcar, n * sizeof(cell),
+				Basesect[0] + c * sizeof(cell),
+				k * (long) sizeof(cell)) < 0 ||
+			baseread(fd, bcdr, n * sizeof(cell),
+				Basesect[1] + c * sizeof(cell),
+				k * (long) sizeof(cell)) < 0 ||
+			baseread(fd, btag, n, Basesect[2] + c, k) < 0)
+		{
+			return "base image read error";
+		}
+		for (i=0; i<n; i++) {
+			j = c+i;
+			if (	!fmap[j] && (Car[j] != bcar[i] ||
+				Cdr[j] != bcdr[i] || Tag[j] != btag[i])
+			)
+				break;
+		}
+		if (i >= n) continue;
+		kind = 0;
+		if (	fwrite(&kind, sizeof(cell), 1, f) != 1 ||
+			fwrite(&c, sizeof(cell), 1, f) != 1 ||
+			fwrite(&Car[c], sizeof(cell), n, f) != n ||
+			fwrite(&Cdr[c], sizeof(cell), n, f) != n ||
+			fwrite(&Tag[c], 1, n, f) != n)
+		{
+			return "image dump failed";
+		}
+	}
+	for (c = 0; c < Freevec; c += DCHUNK) {
+		n = Freevec - c < DCHUNK? Freevec - c: DCHUNK;
+		if (baseread(fd, bcar, n * sizeof(cell),
+				Basesect[3] + c * sizeof(cell),
+				(Basevcells - c) * (long) sizeof(cell)) < 0)
+			return "base image read error";
+		if (memcmp(&Vectors[c], bcar, n * sizeof(cell)) == 0)
+			continue;
+		kind = 1;
+		if (	fwrite(&kind, sizeof(cell), 1, f) != 1 ||
+			fwrite(&c, sizeof(cell), 1, f) != 1 ||
+			fwrite(&Vectors[c], sizeof(cell), n, f) != n)
+		{
+			return "image dump failed";
+		}
+	}
+	kind = -1;
+	return xfwrite(&kind, sizeof(cell), 1, f);
+}
+
+char *dumpdeltaf(FILE *f, int fd) {
+	byte		*fmap;
+	cell		i, k, **v;
+	char		*s;
+
+	gc();
+	if ((fmap = calloc(NNODES, 1)) == NULL)
+		return "out of memory";
+	for (i = Freelist; i != NIL; i = cdr(i))
+		fmap[i] = 1;
+	k = strlen(Basepath);
+	s = dumphdr(f, DELTAFORMAT, Freenode);
+	if (NULL == s) s = xfwrite(&Basesize, sizeof(long), 1, f);
+	if (NULL == s) s = xfwrite(&Basemtime, sizeof(long), 1, f);
+	v = Imagevars;
+	for (i = 0; NULL == s && v[i] != NULL; i++)
+		s = xfwrite(v[i], sizeof(cell), 1, f);
+	if (NULL == s) s = xfwrite(&k, sizeof(cell), 1, f);
+	if (NULL == s) s = xfwrite(Basepath, 1, k, f);
+	if (NULL == s) s = dumpchunks(f, fd, fmap);
+	free(fmap);
+	return s;
+}
+
+char *dumpdelta(char *path) {
+	FILE		*f;
+	struct stat	st;
+	char		*s, b[TOKLEN+5];
+	int		fd;
+
+	if (NULL == Basepath)
+		return "no base image";
+	if (strlen(path) > TOKLEN)
+		return "path too long";
+	fd = open(Basepath, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return "cannot open base image";
+	if (	fstat(fd, &st) < 0 ||
+		st.st_size != Basesize ||
+		st.st_mtime != Basemtime)
+	{
+		close(fd);
+		return "base image has changed";
+	}
+	sprintf(b, "%s.new", path);
+	f = fopen(b, "wb");
+	if (NULL == f) {
+		close(fd);
+		return "cannot create image file";
+	}
+	s = dumpdeltaf(f, fd);
+	close(fd);
+	if (fclose(f) != 0 && NULL == s)
+		s = "image dump failed";
+	if (NULL == s && rename(b, path) < 0)
+		s = "cannot rename image file";
+	if (s != NULL) remove(b);
+	return s;
+}
+
+char *loaddelta(int fd) {
+	struct imghdr	m;
+	struct stat	st;
+	cell		nodes, vcells, symptr, k, c, n, kind;
+	cell		iv[32], **v;
+	long		size, mtime;
+	char		*s, *path;
+	int		i, bfd;
+
+	if (	(s = xfdread(fd, &m, sizeof(m))) != NULL ||
+		(s = ckimghdr(&m, DELTAFORMAT)) != NULL ||
+		(s = xfdread(fd, &nodes, sizeof(cell))) != NULL ||
+		(s = xfdread(fd, &vcells, sizeof(cell))) != NULL ||
+		(s = xfdread(fd, &symptr, sizeof(cell))) != NULL ||
+		(s = xfdread(fd, &size, sizeof(long))) != NULL ||
+		(s = xfdread(fd, &mtime, sizeof(long))) != NULL)
+	{
+		return s;
+	}
+	v = Imagevars;
+	for (i=0; v[i] != NULL; i++)
+		if ((s = xfdread(fd, &iv[i], sizeof(cell))) != NULL)
+			return s;
+	if ((s = xfdread(fd, &k, sizeof(cell))) != NULL)
+		return s;
+	if (k < 1 || k > 65535 || NULL == (path = malloc(k+1)))
+		return "image file read error";
+	if ((s = xfdread(fd, path, k)) != NULL) {
+		free(path);
+		return s;
+	}
+	path[k] = 0;
+	bfd = open(path, O_RDONLY | O_CLOEXEC);
+	if (bfd < 0)
+		s = "cannot open base image";
+	else if (fstat(bfd, &st) < 0)
+		s = "image file read error";
+	else if (st.st_size != size || st.st_mtime != mtime)
+		s = "base image has changed";
+	else if ((s = loadimgfd(bfd, 0, st.st_size)) == NULL)
+		setbase(path, &st);
+	if (bfd >= 0) close(bfd);
+	free(path);
+	if (s != NULL) return s;
+	if (nodes < 0 || nodes > NNODES)
+		return "node pool too small for image";
+	if (vcells < 0 || vcells > NVCELLS)
+		return "vector pool too small for image";
+	for (;;) {
+		if (	(s = xfdread(fd, &kind, sizeof(cell))) != NULL ||
+			(-1 != kind &&
+			 (s = xfdread(fd, &c, sizeof(cell))) != NULL))
+		{
+			return s;
+		}
+		if (-1 == kind) break;
+		k = 0 == kind? nodes: vcells;
+		if (kind < 0 || kind > 1 || c < 0 || c % DCHUNK || c >= k)
+			return "image file read error";
+		n = k - c < DCHUNK? k - c: DCHUNK;
+		if (0 == kind && (
+			(s = xfdread(fd, &Car[c], n * sizeof(cell))) != NULL ||
+			(s = xfdread(fd, &Cdr[c], n * sizeof(cell))) != NULL ||
+			(s = xfdread(fd, &Tag[c], n)) != NULL))
+		{
+			return s;
+		}
+		if (	1 == kind &&
+			(s = xfdread(fd, &Vectors[c], n * sizeof(cell))) != NULL)
+			return s;
+	}
+	for (i=0; v[i] != NULL; i++)
+		*v[i] = iv[i];
+	Freelist = NIL;
+	Freenode = nodes;
+	Freevec = vcells;
+	Symptr = symptr;
+	return NULL;
+}
+
+/*
+ * Executables
+ *
+ * An executable is a copy of the LISP9 binary followed by an
+ * image at the next multiple of IMGALIGN and a trailer containing
+ * EXEMAGIC and the offset of the image as a decimal number. The
+ * image is loaded directly from the executable at startup.
+ */
+
+#define EXEMAGIC	"LISP9EXE"
+#define EXETRAILER	24
+
+char	*Argv0 = NULL;
+
+int openself(void) {
+	int	fd;
+
+	fd = -1;
+#ifdef __linux__
+	fd = open("/proc/self/exe", O_RDONLY | O_CLOEXEC);
+#endif
+	if (fd < 0 && Argv0 != NULL && strchr(Argv0, '/') != NULL)
+		fd = open(Argv0, O_RDONLY | O_CLOEXEC);
+	return fd;
+}
+
+/*
+ * Return the path of the running executable.
+ */
+
+cell progpath(void) {
+	char	b[4096];
+	int	k;
+
+	k = -1;
+#ifdef __linux__
+	k = readlink("/proc/self/exe", b, sizeof(b)-1);
+#endif
+	if (k > 0) return mkstr(b, k);
+	return mkstr(Argv0, strlen(Argv0));
+}
+
+/*
+ * Return the offset of the image embedded in the executable FD,
+ * or -1 if there is none. Store the size of the file in *SIZE.
+ */
+
+long exeimage(int fd, long *size) {
+	struct stat	st;
+	char		t[EXETRAILER+1];
+	long		base;
+	int		i;
+
+	if (fstat(fd, &st) < 0) return -1;
+	*size = st.st_size;
+	if (	st.st_size < EXETRAILER ||
+		pread(fd, t, EXETRAILER, st.st_size - EXETRAILER)
+		 != EXETRAILER ||
+		memcmp(t, EXEMAGIC, strlen(EXEMAGIC))
+	)
+		return -1;
+	base = 0;
+	for (i = strlen(EXEMAGIC); i < EXETRAILER; i++) {
+		if (!isdigit(t[i])) return -1;
+		base = base * 10 + t[i] - '0';
+	}
+	if (base % IMGALIGN != 0 || base > st.st_size - EXETRAILER)
+		return -1;
+	return base;
+}
+
+char *dumpexec(char *path, int shake) {
+	char	b[TOKLEN+1], buf[4096], *s;
+	int	fd, k;
+	long	n, base, size;
+	FILE	*f;
 
-	if (strlen(path)+7 >= TOKLEN)
-		error("image path too long", UNDEF);
+	if (strlen(path) > TOKLEN)
+		return "path too long";
 	strcpy(b, path);
-	p = strrchr(b, '.');
-	if (NULL == p) p = b+strlen(b);
-	*p = 0;
-	strcat(b, ".oimage");
+	if ((fd = openself()) < 0)
+		return "cannot open LISP9 executable";
+	n = exeimage(fd, &size);
+	if (n < 0) n = size;
 	remove(b);
-	rename(path, b);
+	f = fopen(b, "wb");
+	if (NULL == f) {
+		close(fd);
+		return "cannot create executable";
+	}
+	s = NULL;
+	lseek(fd, 0, SEEK_SET);
+	for (base = 0; NULL == s && base < n; base += k) {
+		k = n - base < sizeof(buf)? n - base: sizeof(buf);
+		if (read(fd, buf, k) != k || fwrite(buf, 1, k, f) != k)
+			s = "executable dump failed";
+	}
+	close(fd);
+	base = imgalign(n);
+	if (NULL == s && fseek(f, base, SEEK_SET) < 0)
+		s = "executable dump failed";
+	if (NULL == s)
+		s = shake? shakeimgf(f, base): dumpimgf(f, base);
+	if (NULL == s) {
+		fseek(f, 0, SEEK_END);
+		if (fprintf(f, "%s%0*ld", EXEMAGIC,
+			EXETRAILER - (int) strlen(EXEMAGIC), base) < 0)
+		{
+			s = "executable dump failed";
+		}
+	}
+	if (fclose(f) != 0 && NULL == s)
+		s = "executable dump failed";
+	if (NULL == s && chmod(b, 0755) < 0)
+		s = "cannot make file executable";
+	return s;
 }
 
-cell *Imagevars[];
+/*
+ * Load the image embedded in the running executable, if any.
+ */
 
-char *dumpimg(char *path) {
-	FILE		*f;
-	cell		n, **v;
-	int		i;
-	struct imghdr	m;
-	char		*s;
+int loadexec(void) {
+	int	fd;
+	long	base, size;
+	char	*s;
 
-	saveimg(path);
-	f = fopen(path, "wb");
-	if (NULL == f) return "cannot create image file";
-	memset(&m, '_', sizeof(m));
-	strncpy(m.magic, "LISP9", sizeof(m.magic));
-	strncpy(m.version, VERSION, sizeof(m.version));
-	m.cell_size[0] = sizeof(cell)+'0';
-	n = 0x31323334L;
-	memcpy(m.byte_order, &n, 4);
-	if ((s = xfwrite(&m, sizeof(m), 1, f)) != NULL) {
-		fclose(f);
-		return s;
+	if ((fd = openself()) < 0)
+		return 0;
+	base = exeimage(fd, &size);
+	if (base < 0) {
+		close(fd);
+		return 0;
 	}
-	i = NNODES;
-	if ((s = xfwrite(&i, sizeof(int), 1, f)) != NULL) {
-		fclose(f);
-		return s;
+	s = loadimgfd(fd, base, size - EXETRAILER - base);
+	close(fd);
+	if (s != NULL) fatal(s);
+	return 1;
+}
+
+/*
+ * Tree shaking
+ *
+ * A tree-shaken image contains only the START function and the
+ * data reachable from it. Global bindings are kept, if some kept
+ * closure refers to them, and so are the bindings used by the
+ * interpreter itself (see init()). Macros are dropped. Then the
+ * symbol table and the literal pool are rebuilt, containing only
+ * the symbols and literals that are still in use, and the bytecode
+ * is patched to refer to their new slots.
+ *
+ * Because shaking modifies the running system beyond repair, the
+ * image is written by a child process, which exits afterwards.
+ */
+
+THREAD cell	Prog, Acc, E0, Ep, Argv;
+
+THREAD byte	*Shmark, *Obkeep;
+THREAD cell	*Shstack;
+THREAD int	Shsp, Shlen;
+
+int shpush(cell n) {
+	cell	*p;
+
+	if (specialp(n) || Shmark[n]) return 0;
+	Shmark[n] = 1;
+	if (Shsp >= Shlen) {
+		p = realloc(Shstack, (Shlen + CHUNKSIZE) * sizeof(cell));
+		if (NULL == p) return -1;
+		Shstack = p;
+		Shlen += CHUNKSIZE;
 	}
-	i = NVCELLS;
-	if ((s = xfwrite(&i, sizeof(int), 1, f)) != NULL) {
-		fclose(f);
-		return s;
+	Shstack[Shsp++] = n;
+	return 0;
+}
+
+int shcode(cell p) {
+	int	i, k, op, r;
+	byte	*v;
+
+	k = stringlen(p);
+	v = string(p);
+	r = 0;
+	for (i=0; i<k; i += opsize(op)) {
+		op = v[i];
+		if (OP_QUOTE == op) {
+			Obkeep[fetcharg(v, i+1)] = 1;
+			r |= shpush(vector(Obarray)[fetcharg(v, i+1)]);
+		}
+		else if (OP_MACRO == op) {
+			r |= shpush(vector(Symbols)[fetcharg(v, i+1)]);
+		}
+		else if (OP_REF == op) {
+			r |= shpush(vector(Symbols)[fetcharg(v, i+3)]);
+		}
 	}
-	i = 0;
-	v = Imagevars;
-	while (v && v[i]) {
-		if ((s = xfwrite(v[i], sizeof(cell), 1, f)) != NULL) {
-			fclose(f);
-			return s;
+	return r;
+}
+
+/*
+ * Closures without free variables inherit the environment of their
+ * context, which is the global environment E0 for closures created
+ * at the top level. When the code of a closure never refers to its
+ * environment, the environment is replaced by an empty one, which
+ * keeps the closure from dragging the whole global environment into
+ * the image. The code of a closure extends from its entry point to
+ * the target of the jump that precedes it, see compcls(). The code
+ * of nested closures is skipped; their environments are built by
+ * MKENV and CPREF after the jump, in the code of the enclosing one.
+ */
+
+int envrefp(cell c) {
+	int	i, j, k, op;
+	byte	*v;
+
+	v = string(cdr(cadddr(c)));
+	i = fixval(cadr(c));
+	k = fetcharg(v, i-ISIZE1+1);
+	while (i < k) {
+		op = v[i];
+		if (OP_REF == op || OP_SETREF == op || OP_CPREF == op)
+			return 1;
+		if (OP_JMP == op) {
+			j = fetcharg(v, i+1);
+			if (OP_MKENV == v[j] || OP_PROPENV == v[j]) {
+				i = j;
+				continue;
+			}
 		}
-		i++;
+		i += opsize(op);
 	}
-	if (	fwrite(Car, 1, sizeof(cell) * NNODES, f)
-		 != sizeof(cell) * NNODES ||
-		fwrite(Cdr, 1, sizeof(cell) * NNODES, f)
-		 != sizeof(cell) * NNODES ||
-		fwrite(Tag, 1, NNODES, f) != NNODES||
-		fwrite(Vectors, 1, sizeof(cell) * NVCELLS, f)
-		 != sizeof(cell) * NVCELLS)
-	{
-		fclose(f);
-		return "image dump failed";
+	return 0;
+}
+
+int shwalk(void) {
+	cell	n;
+	int	i, k, r;
+
+	r = 0;
+	while (Shsp > 0) {
+		n = Shstack[--Shsp];
+		if (tag(n) & VECTOR_TAG) {
+			if (T_VECTOR != car(n)) continue;
+			k = veclen(n);
+			for (i=0; i<k; i++)
+				r |= shpush(vector(n)[i]);
+		}
+		else if (tag(n) & ATOM_TAG) {
+			if (T_CLOSURE == car(n) && !envrefp(n))
+				caddr(n) = Nullvec;
+			if (T_BYTECODE == car(n))
+				r |= shcode(cdr(n));
+			r |= shpush(cdr(n));
+		}
+		else {
+			r |= shpush(car(n));
+			r |= shpush(cdr(n));
+		}
+	}
+	return r;
+}
+
+void shpatch(cell p, int *symmap, int *obmap) {
+	int	i, j, k, op, x;
+	byte	*v;
+
+	k = stringlen(p);
+	v = string(p);
+	for (i=0; i<k; i += opsize(op)) {
+		op = v[i];
+		if (OP_QUOTE == op) {
+			j = i+1;
+			x = obmap[fetcharg(v, j)];
+		}
+		else if (OP_MACRO == op) {
+			j = i+1;
+			x = symmap[fetcharg(v, j)];
+		}
+		else if (OP_REF == op) {
+			j = i+3;
+			x = symmap[fetcharg(v, j)];
+		}
+		else {
+			continue;
+		}
+		v[j] = x >> 8;
+		v[j+1] = x & 255;
+	}
+}
+
+int interpsym(cell y) {
+	return	S_errtag == y || S_errval == y || S_imagefile == y ||
+		S_program == y || S_quiet == y || S_starstar == y ||
+		S_start == y;
+}
+
+char *shake(void) {
+	cell	n, g, y, v;
+	int	i, j, k, nsym, nob, *symmap, *obmap;
+
+	nob = veclen(Obarray);
+	Shmark = calloc(NNODES, 1);
+	Obkeep = calloc(nob, 1);
+	symmap = malloc(Symptr * sizeof(int));
+	obmap = malloc(nob * sizeof(int));
+	if (NULL == Shmark || NULL == Obkeep || NULL == symmap ||
+	    NULL == obmap)
+		return "out of memory";
+	bindset(S_starstar, NIL);
+	for (n = Glob; n != NIL; n = cdr(n))
+		if (interpsym(caar(n)) && shpush(car(n)) < 0)
+			return "out of memory";
+	do {
+		if (shwalk() < 0) return "out of memory";
+		k = 0;
+		for (n = Glob; n != NIL; n = cdr(n)) {
+			if (!Shmark[car(n)] && Shmark[cdar(n)]) {
+				if (shpush(car(n)) < 0) return "out of memory";
+				k = 1;
+			}
+		}
+	} while (k);
+
+	for (nsym = i = 0; i < Symptr; i++) {
+		y = vector(Symbols)[i];
+		symmap[i] = 0 == i || (!specialp(y) && Shmark[y])? nsym++: 0;
+	}
+	v = mkvec(nsym + CHUNKSIZE);
+	protect(v);
+	for (i = 0; i < Symptr; i++)
+		if (0 == i || symmap[i] != 0)
+			vector(v)[symmap[i]] = vector(Symbols)[i];
+	n = mkht(nsym);
+	protect(n);
+	for (i = 0; i < nsym; i++)
+		htadd(n, vector(v)[i], mkfix(i));
+
+	for (j = i = 0; i < nob; i++)
+		obmap[i] = Obkeep[i]? j++: 0;
+	k = j + CHUNKSIZE < nob? j + CHUNKSIZE: nob;
+	Tmp = mkvec(k);
+	g = cons(Tmp, NIL);
+	Tmp = NIL;
+	protect(g);
+	Tmp = mkstr(NULL, k);
+	cdr(g) = Tmp;
+	Tmp = NIL;
+	memset(string(cdr(g)), OBFREE, k);
+	memset(string(cdr(g)), OBALLOC, j);
+	for (i = 0; i < nob; i++)
+		if (Obkeep[i])
+			vector(car(g))[obmap[i]] = vector(Obarray)[i];
+	Tmp = mkht(j);
+	g = cons(Tmp, g);
+	Tmp = NIL;
+	car(Protected) = g;
+	for (i = 0; i < j; i++) {
+		y = vector(cadr(g))[i];
+		if (!pairp(y) && !vectorp(y) && !closurep(y))
+			htadd(car(g), y, mkfix(i));
 	}
-	fclose(f);
+
+	protect(y = NIL);
+	for (n = Glob; n != NIL; n = cdr(n)) {
+		if (Shmark[car(n)]) {
+			y = cons(car(n), y);
+			car(Protected) = y;
+		}
+	}
+	Glob = nreverse(unprot(1));
+	for (i = 0; i < NNODES; i++)
+		if (Shmark[i] && (tag(i) & ATOM_TAG) && T_BYTECODE == car(i))
+			shpatch(cdr(i), symmap, obmap);
+	g = unprot(1);
+	Obhash = car(g);
+	Obarray = cadr(g);
+	Obmap = cddr(g);
+	Obptr = j < k? j: 0;
+	Symhash = unprot(1);
+	Symbols = unprot(1);
+	Symptr = nsym;
+	Macros = Defined = NIL;
+	Protected = Prog = Env = Cts = Emitbuf = Acc = NIL;
+	E0 = Ep = Rts = Argv = Files = NIL;
+	Sp = -1;
 	return NULL;
 }
 
-char *xfread(void *buf, int siz, int n, FILE *f) {
-	if (fread(buf, siz, n, f) != n)
-		return "image file read error";
+char *shakeimgf(FILE *f, long base) {
+	pid_t	pid;
+	int	st;
+	char	*s;
+
+	fflush(f);
+	flush_ports();
+	pid = fork();
+	if (pid < 0) return "cannot fork";
+	if (0 == pid) {
+		if (setjmp(Restart) != 0) _exit(EXIT_FAILURE);
+		bindset(S_errtag, NIL);
+		s = shake();
+		if (NULL == s) s = dumpimgf(f, base);
+		if (s != NULL) fprintf(stderr, "*** %s\n", s);
+		_exit(NULL == s? EXIT_SUCCESS: EXIT_FAILURE);
+	}
+	while (waitpid(pid, &st, 0) < 0)
+		if (errno != EINTR) return "image dump failed";
+	if (!WIFEXITED(st) || WEXITSTATUS(st) != 0)
+		return "image dump failed";
 	return NULL;
 }
 
-char *loadimg(char *path) {
-	FILE		*f;
-	cell		n, **v;
-	int		i;
-	struct imghdr	m;
-	int		image_nodes, image_vcells;
-	char		*s;
+void ckstart(char *who, cell shake) {
+	cell	n;
+	char	b[100];
 
-	f = fopen(path, "rb");
-	if (NULL == f)
-		return "could not open file";
-	if ((s = xfread(&m, sizeof(m), 1, f)) != NULL)
-		return s;
-	if (memcmp(m.magic, "LISP9", sizeof(m.magic))) {
-		fclose(f);
-		return "imghdr match failed";
+	if (NIL == shake) return;
+	n = assq(S_start, Glob);
+	if (NIL == n || !closurep(cadr(n))) {
+		sprintf(b, "%s: START is not a function", who);
+		error(b, NIL == n? UNDEF: cadr(n));
 	}
-	if (memcmp(m.version, VERSION, sizeof(m.version))) {
-		fclose(f);
-		return "wrong image version";
+}
+
+void dump_delta(cell s) {
+	char	*rc;
+
+	rc = dumpdelta((char *) string(s));
+	if (rc != NULL) error(rc, s);
+}
+
+void dump_image(cell s, cell shake) {
+	char	*rc;
+
+	ckstart("dump-image", shake);
+	rc = dumpimg((char *) string(s), shake != NIL);
+	if (rc != NULL) {
+		remove((char *) string(s));
+		error(rc, s);
 	}
-	if (m.cell_size[0]-'0' != sizeof(cell)) {
-		fclose(f);
-		return "wrong cell size";
+	bindset(S_imagefile, s);
+}
+
+void dump_exec(cell s, cell shake) {
+	char	*rc;
+
+	ckstart("dump-executable", shake);
+	rc = dumpexec((char *) string(s), shake != NIL);
+	if (rc != NULL) {
+		remove((char *) string(s));
+		error(rc, s);
 	}
-	memcpy(&n, m.byte_order, sizeof(cell));
-	if (n != 0x31323334L) {
-		fclose(f);
-		return "wrong byte order";
+}
+
+/*
+ * Isolates
+ *
+ * An isolate is an interpreter instance with a heap of its own,
+ * running on a thread of its own. ISOLATE copies the heap of
+ * the calling isolate and starts a thread that applies a
+ * function of no arguments in the copy. ISOLATE-WAIT waits
+ * for the thread to finish and deserializes the serialized
+ * value of the function in the heap of its caller. It waits
+ * on Isodone rather than in pthread_join(), so that it can be
+ * interrupted and the isolate be waited for again. SPAWN
+ * starts a detached isolate, whose value is discarded. Isolates
+ * share no nodes, so they never lock anything but the tables
+ * of handles and channels.
+ */
+
+#ifdef ISOLATES
+
+struct isolate {
+	pthread_t	thread;
+	cell		*car, *cdr, *vecs;
+	byte		*tag;
+	cell		freelist, freenode, freevec;
+	cell		symbols, symhash, symptr, glob, macros;
+	cell		obhash, obarray, obmap, defined, argv, fn;
+	int		obptr, detach, done, waited;
+	byte		*val;
+	int		len;
+};
+
+struct isolate	*Isolates[NISOLATES];
+pthread_mutex_t	Isolock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t	Isodone = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Wait for C with a timeout, so that keyboard interrupts
+ * are noticed. Return 1, if interrupted.
+ */
+
+int waitintr(pthread_cond_t *c, pthread_mutex_t *m) {
+	struct timespec	t;
+
+	clock_gettime(CLOCK_REALTIME, &t);
+	t.tv_nsec += 100000000L;
+	if (t.tv_nsec >= 1000000000L) {
+		t.tv_sec++;
+		t.tv_nsec -= 1000000000L;
 	}
-	memset(Tag, 0, NNODES);
-	if ((s = xfread(&image_nodes, sizeof(int), 1, f)) != NULL)
-		return s;
-	if ((s = xfread(&image_vcells, sizeof(int), 1, f)) != NULL)
-		return s;
-	if (image_nodes != NNODES) {
-		fclose(f);
-		return "wrong node pool size";
+	pthread_cond_timedwait(c, m, &t);
+	return Intr;
+}
+
+void initports(void);
+void initroots(void);
+void initrts(void);
+
+void isofree(void) {
+	int	i;
+
+	for (i=3; i<Nports; i++)
+		close_port(i);
+	flush_ports();
+	for (i=0; i<3; i++)
+		free(Port_buf[i]);
+	free(Port_fd); free(Port_buf); free(Port_pos); free(Port_lim);
+	free(Port_size); free(Port_flags); free(Port_str); free(Port_cb);
+	free(Port_ptr); free(Port_free);
+	if (Epfd >= 0) close(Epfd);
+	srfree();
+	free(Srbuf);
+	dsfree();
+	free(Dstmp);
+	free_pools();
+}
+
+void *isorun(void *p) {
+	struct isolate	*iso = p;
+	cell		n;
+
+	Car = iso->car;
+	Cdr = iso->cdr;
+	Tag = iso->tag;
+	Vectors = iso->vecs;
+	Freelist = iso->freelist;
+	Freenode = iso->freenode;
+	Freevec = iso->freevec;
+	Symbols = iso->symbols;
+	Symhash = iso->symhash;
+	Symptr = iso->symptr;
+	Glob = iso->glob;
+	Macros = iso->macros;
+	Obhash = iso->obhash;
+	Obarray = iso->obarray;
+	Obmap = iso->obmap;
+	Obptr = iso->obptr;
+	Defined = iso->defined;
+	Argv = iso->argv;
+	initroots();
+	initports();
+	if (setjmp(Restart) == 0) {
+		clrtrace();
+		bindset(S_errtag, NIL);
+		n = cons(iso->fn, NIL);
+		protect(n);
+		initrts();
+		n = eval(unprot(1), 0);
+		if (!iso->detach)
+			iso->val = srtake(n, &iso->len);
+	}
+	isofree();
+	if (iso->detach) {
+		free(iso);
+		return NULL;
+	}
+	pthread_mutex_lock(&Isolock);
+	iso->done = 1;
+	pthread_cond_broadcast(&Isodone);
+	pthread_mutex_unlock(&Isolock);
+	return NULL;
+}
+
+cell isolate(cell fn, int detach) {
+	struct isolate	*iso;
+	sigset_t	set, old;
+	pthread_attr_t	attr;
+	int		h, rc;
+
+	h = -1;
+	if (detach) {
+		iso = calloc(1, sizeof(struct isolate));
 	}
-	if (image_vcells != NVCELLS) {
-		fclose(f);
-		return "wrong vector pool size";
+	else {
+		pthread_mutex_lock(&Isolock);
+		for (h=0; h<NISOLATES; h++)
+			if (NULL == Isolates[h])
+				break;
+		iso = h < NISOLATES? calloc(1, sizeof(struct isolate)):
+			NULL;
+		if (iso != NULL) Isolates[h] = iso;
+		pthread_mutex_unlock(&Isolock);
+	}
+	if (NULL == iso) error("isolate: too many isolates", UNDEF);
+	iso->car = alloc_pool(sizeof(cell) * NNODES);
+	iso->cdr = alloc_pool(sizeof(cell) * NNODES);
+	iso->tag = alloc_pool(NNODES);
+	iso->vecs = alloc_pool(sizeof(cell) * NVCELLS);
+	rc = NULL == iso->car || NULL == iso->cdr || NULL == iso->tag ||
+		NULL == iso->vecs;
+	if (0 == rc) {
+		memcpy(iso->car, Car, sizeof(cell) * Freenode);
+		memcpy(iso->cdr, Cdr, sizeof(cell) * Freenode);
+		memcpy(iso->tag, Tag, Freenode);
+		memcpy(iso->vecs, Vectors, sizeof(cell) * Freevec);
+		iso->freelist = Freelist;
+		iso->freenode = Freenode;
+		iso->freevec = Freevec;
+		iso->symbols = Symbols;
+		iso->symhash = Symhash;
+		iso->symptr = Symptr;
+		iso->glob = Glob;
+		iso->macros = Macros;
+		iso->obhash = Obhash;
+		iso->obarray = Obarray;
+		iso->obmap = Obmap;
+		iso->obptr = Obptr;
+		iso->defined = Defined;
+		iso->argv = Argv;
+		iso->fn = fn;
+		iso->detach = detach;
+		pthread_attr_init(&attr);
+		if (detach)
+			pthread_attr_setdetachstate(&attr,
+				PTHREAD_CREATE_DETACHED);
+		sigemptyset(&set);
+		sigaddset(&set, SIGINT);
+		pthread_sigmask(SIG_BLOCK, &set, &old);
+		rc = pthread_create(&iso->thread, &attr, isorun, iso);
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+		pthread_attr_destroy(&attr);
+	}
+	if (rc) {
+		if (iso->car) munmap(iso->car, sizeof(cell) * NNODES);
+		if (iso->cdr) munmap(iso->cdr, sizeof(cell) * NNODES);
+		if (iso->tag) munmap(iso->tag, NNODES);
+		if (iso->vecs) munmap(iso->vecs, sizeof(cell) * NVCELLS);
+		if (h >= 0) {
+			pthread_mutex_lock(&Isolock);
+			Isolates[h] = NULL;
+			pthread_mutex_unlock(&Isolock);
+		}
+		free(iso);
+		error("isolate: cannot start isolate", UNDEF);
+	}
+	return detach? NIL: mkfix(h);
+}
+
+cell isolate_wait(cell h) {
+	struct isolate	*iso;
+	int		k;
+	byte		*b;
+
+	k = fixval(h);
+	pthread_mutex_lock(&Isolock);
+	iso = k < 0 || k >= NISOLATES? NULL: Isolates[k];
+	if (NULL == iso || iso->waited) {
+		pthread_mutex_unlock(&Isolock);
+		error("isolate-wait: no such isolate", h);
+	}
+	iso->waited = 1;
+	while (!iso->done) {
+		if (waitintr(&Isodone, &Isolock)) {
+			iso->waited = 0;
+			pthread_mutex_unlock(&Isolock);
+			error("interrupted", UNDEF);
+		}
 	}
-	v = Imagevars;
-	i = 0;
-	while (v && v[i]) {
-		if ((s = xfread(v[i], sizeof(cell), 1, f)) != NULL)
-			return s;
-		i++;
+	Isolates[k] = NULL;
+	pthread_mutex_unlock(&Isolock);
+	pthread_join(iso->thread, NULL);
+	if (NULL == iso->val) {
+		free(iso);
+		error("isolate-wait: isolate failed", h);
 	}
-	if (	(fread(Car, 1, sizeof(cell) * NNODES, f)
-		  != sizeof(cell) * NNODES ||
-		 fread(Cdr, 1, sizeof(cell) * NNODES, f)
-		  != sizeof(cell) * NNODES ||
-		 fread(Tag, 1, NNODES, f) != NNODES ||
-		 fread(Vectors, 1, sizeof(cell) * NVCELLS, f)
-		  != sizeof(cell) * NVCELLS ||
-		 fgetc(f) != EOF))
+	b = iso->val;
+	k = iso->len;
+	free(iso);
+	return dstake(b, k);
+}
+
+/*
+ * Channels are bounded queues of serialized messages, which
+ * are shared by all isolates. A message is serialized in the
+ * heap of its sender and deserialized in the heap of its
+ * receiver, and the buffer in between changes hands without
+ * being copied. CHANNEL-SEND waits while the channel is full
+ * and CHANNEL-RECEIVE waits while it is empty. When a channel
+ * has been closed and drained, it is released and receiving
+ * from it delivers EOF.
+ *
+ * Handles encode the slot of a channel and the generation of
+ * that slot, so stale handles are recognized.
+ */
+
+struct message {
+	byte	*buf;
+	int	len;
+};
+
+struct channel {
+	pthread_cond_t	notempty, notfull;
+	struct message	*msgs;
+	cell		id;
+	int		size, head, count, waiters, closed;
+};
+
+struct channel	*Channels[NCHANNELS];
+cell		Changen[NCHANNELS];
+pthread_mutex_t	Chanlock = PTHREAD_MUTEX_INITIALIZER;
+
+cell mkchannel(cell n) {
+	struct channel	*ch;
+	int		i, k;
+	cell		h;
+
+	if (!fixp(n) || fixval(n) < 1)
+		expect("make-channel", "positive fixnum", n);
+	k = fixval(n);
+	if ((ch = calloc(1, sizeof(struct channel))) != NULL &&
+	    (ch->msgs = malloc(k * sizeof(struct message))) == NULL)
 	{
-		fclose(f);
-		return "wrong file size";
+		free(ch);
+		ch = NULL;
+	}
+	if (NULL == ch) error("make-channel: out of memory", n);
+	ch->size = k;
+	pthread_cond_init(&ch->notempty, NULL);
+	pthread_cond_init(&ch->notfull, NULL);
+	pthread_mutex_lock(&Chanlock);
+	for (i=0; i<NCHANNELS; i++)
+		if (NULL == Channels[i])
+			break;
+	h = -1;
+	if (i < NCHANNELS) {
+		h = ch->id = i + NCHANNELS * Changen[i]++;
+		Channels[i] = ch;
+	}
+	pthread_mutex_unlock(&Chanlock);
+	if (h < 0) {
+		pthread_cond_destroy(&ch->notempty);
+		pthread_cond_destroy(&ch->notfull);
+		free(ch->msgs);
+		free(ch);
+		error("make-channel: too many channels", UNDEF);
 	}
-	fclose(f);
+	return mkfix(h);
+}
+
+/*
+ * Find the channel with handle X, holding Chanlock.
+ * Return NULL, if the channel has been closed and released.
+ */
+
+struct channel *chanref(char *who, cell x) {
+	struct channel	*ch;
+	cell		h, i;
+
+	h = fixp(x)? fixval(x): -1;
+	if (h < 0) expect(who, "channel", x);
+	i = h % NCHANNELS;
+	pthread_mutex_lock(&Chanlock);
+	ch = Channels[i];
+	if (ch != NULL && ch->id == h) return ch;
+	if (h / NCHANNELS < Changen[i]) return NULL;
+	pthread_mutex_unlock(&Chanlock);
+	expect(who, "channel", x);
 	return NULL;
 }
 
-void dump_image(cell s) {
-	char	*rc;
+void chanfree(struct channel *ch) {
+	if (!ch->closed || ch->count || ch->waiters) return;
+	Channels[ch->id % NCHANNELS] = NULL;
+	pthread_cond_destroy(&ch->notempty);
+	pthread_cond_destroy(&ch->notfull);
+	free(ch->msgs);
+	free(ch);
+}
 
-	rc = dumpimg((char *) string(s));
-	if (rc != NULL) {
-		remove((char *) string(s));
-		error(rc, s);
+int chanwait(struct channel *ch, pthread_cond_t *c) {
+	int	r;
+
+	ch->waiters++;
+	r = waitintr(c, &Chanlock);
+	ch->waiters--;
+	return r;
+}
+
+cell chansend(cell x, cell v) {
+	struct channel	*ch;
+	struct message	m;
+	char		*err;
+
+	if (!fixp(x)) expect("channel-send", "channel", x);
+	m.buf = srtake(v, &m.len);
+	err = NULL;
+	if ((ch = chanref("channel-send", x)) != NULL) {
+		while (ch->count >= ch->size && !ch->closed) {
+			if (chanwait(ch, &ch->notfull)) {
+				err = "interrupted";
+				break;
+			}
+		}
+		if (NULL == err && ch->closed)
+			err = "channel-send: channel is closed";
+		if (NULL == err) {
+			ch->msgs[(ch->head + ch->count) % ch->size] = m;
+			ch->count++;
+			pthread_cond_signal(&ch->notempty);
+		}
+		else {
+			chanfree(ch);
+		}
 	}
-	bindset(S_imagefile, s);
+	else {
+		err = "channel-send: channel is closed";
+	}
+	pthread_mutex_unlock(&Chanlock);
+	if (err != NULL) {
+		free(m.buf);
+		error(err, x);
+	}
+	return v;
+}
+
+cell chanrecv(cell x) {
+	struct channel	*ch;
+	struct message	m;
+
+	if ((ch = chanref("channel-receive", x)) == NULL) {
+		pthread_mutex_unlock(&Chanlock);
+		return EOFMARK;
+	}
+	while (0 == ch->count && !ch->closed) {
+		if (chanwait(ch, &ch->notempty)) {
+			chanfree(ch);
+			pthread_mutex_unlock(&Chanlock);
+			error("interrupted", UNDEF);
+		}
+	}
+	if (0 == ch->count) {
+		chanfree(ch);
+		pthread_mutex_unlock(&Chanlock);
+		return EOFMARK;
+	}
+	m = ch->msgs[ch->head];
+	ch->head = (ch->head + 1) % ch->size;
+	ch->count--;
+	pthread_cond_signal(&ch->notfull);
+	chanfree(ch);
+	pthread_mutex_unlock(&Chanlock);
+	return dstake(m.buf, m.len);
+}
+
+cell chanclose(cell x) {
+	struct channel	*ch;
+
+	if ((ch = chanref("channel-close", x)) != NULL) {
+		ch->closed = 1;
+		pthread_cond_broadcast(&ch->notempty);
+		pthread_cond_broadcast(&ch->notfull);
+		chanfree(ch);
+	}
+	pthread_mutex_unlock(&Chanlock);
+	return x;
+}
+
+#else
+
+cell isolate(cell fn, int detach) {
+	error("isolate: isolates are not supported", UNDEF);
+	return UNDEF;
+}
+
+cell isolate_wait(cell h) {
+	error("isolate-wait: isolates are not supported", UNDEF);
+	return UNDEF;
+}
+
+cell mkchannel(cell n) {
+	error("make-channel: isolates are not supported", UNDEF);
+	return UNDEF;
+}
+
+cell chansend(cell x, cell v) {
+	error("channel-send: isolates are not supported", UNDEF);
+	return UNDEF;
+}
+
+cell chanrecv(cell x) {
+	error("channel-receive: isolates are not supported", UNDEF);
+	return UNDEF;
+}
+
+cell chanclose(cell x) {
+	error("channel-close: isolates are not supported", UNDEF);
+	return UNDEF;
 }
 
+#endif
+
 /*
  * Inline functions, misc
  */
@@ -4332,7 +8780,7 @@ cell b_gc(void) {
 }
 
 cell gensym(void) {
-	static int	id = 0;
+	static THREAD int	id = 0;
 	char		b[100];
 
 	id++;
@@ -4351,20 +8799,20 @@ cell untag(cell x) {
  * Abstract machine
  */
 
-cell	Prog = NIL;
+THREAD cell	Prog = NIL;
 
-int	Ip = 0;
+THREAD int	Ip = 0;
 
-cell	Acc = NIL;
+THREAD cell	Acc = NIL;
 
-int	Sz = CHUNKSIZE;
+THREAD int	Sz = CHUNKSIZE;
 
-cell	Rts = NIL;
-int	Sp = -1,
-	Fp = -1;
+THREAD cell	Rts = NIL;
+THREAD int	Sp = -1,
+		Fp = -1;
 
-cell	E0 = NIL,
-	Ep = NIL;
+THREAD cell	E0 = NIL,
+		Ep = NIL;
 
 #define ins()		(string(cdr(Prog))[Ip])
 
@@ -4397,6 +8845,9 @@ void stkalloc(int k) {
 			k = Sp+k-Sz;
 			k = CHUNKSIZE * (1 + (k / CHUNKSIZE));
 		}
+		else if (Sz < CHUNKSIZE && Sp + k < 2 * Sz) {
+			k = Sz;		/* coroutine stacks start small */
+		}
 		else {
 			k = CHUNKSIZE;
 		}
@@ -4561,10 +9012,220 @@ void entcol(int fix) {
 	Fp = Sp-4;
 }
 
+/*
+ * Coroutines
+ *
+ * A coroutine owns a runtime stack, a copy of the VM registers,
+ * and its own values of *ERRTAG*, *ERRVAL*, and *UNWIND*.
+ * RESUME* and YIELD* swap all of them with those of the running
+ * code, so a switch does not allocate any nodes. The C stack is
+ * not switched, though, so a coroutine must yield in the same
+ * invocation of RUN() that resumed it, i.e. not from inside of
+ * EVAL or LOAD.
+ *
+ * When a non-blocking read in a coroutine would block, the
+ * coroutine is suspended in the WAITING state and the port is
+ * passed to its resumer. The read is retried when the coroutine
+ * is resumed the next time.
+ */
+
+#define CO_RTS		0
+#define CO_PROG		1
+#define CO_EP		2
+#define CO_ACC		3
+#define CO_CALLER	4
+#define CO_REGS		5
+#define CO_DYN		6
+#define CO_SLOTS	9
+
+#define CR_SZ		0
+#define CR_SP		1
+#define CR_FP		2
+#define CR_IP		3
+#define CR_STATE	4
+#define CR_DEPTH	5
+#define CR_REGS		6
+
+#define CS_SUSPENDED	0
+#define CS_RUNNING	1
+#define CS_WAITING	2
+#define CS_DEAD		3
+
+#define CORTS		64
+
+#define coslots(c)	vector(cdr(c))
+#define coregs(c)	((int *) string(coslots(c)[CO_REGS]))
+
+THREAD int	Rdepth = 0;
+THREAD cell	Dynbox[3] = { NIL, NIL, NIL };
+
+cell mkcoroutine(cell fn) {
+	cell	c, n, *v;
+	int	*r;
+
+	if (!closurep(fn)) expect("coroutine", "function", fn);
+	c = mkvec(CO_SLOTS);
+	protect(c);
+	n = mkstr(NULL, CR_REGS * sizeof(int));
+	vector(c)[CO_REGS] = n;
+	n = mkvec(CORTS);
+	vector(c)[CO_RTS] = n;
+	n = mkstr(NULL, 1);
+	string(n)[0] = OP_COEND;
+	n = mkatom(T_BYTECODE, n);
+	n = cons(Zero, n);
+	v = vector(vector(c)[CO_RTS]);
+	v[0] = Zero;
+	v[2] = n;
+	v = vector(c);
+	v[CO_PROG] = closure_prog(fn);
+	v[CO_EP] = closure_env(fn);
+	r = (int *) string(v[CO_REGS]);
+	r[CR_SZ] = CORTS;
+	r[CR_SP] = 2;
+	r[CR_FP] = -1;
+	r[CR_IP] = fixval(closure_ip(fn));
+	r[CR_STATE] = CS_SUSPENDED;
+	c = mkatom(T_COROUTINE, c);
+	unprot(1);
+	return c;
+}
+
+void coswap(cell c) {
+	cell	*v, t, b;
+	int	*r, i;
+	static cell	*dyn[] = { &S_errtag, &S_errval, &S_unwind };
+
+	/* GC marks all of a stack that is not Rts */
+	v = vector(Rts);
+	for (i = Sp+1; i < Sz; i++)
+		v[i] = NIL;
+	v = coslots(c);
+	t = Rts;  Rts = v[CO_RTS];  v[CO_RTS] = t;
+	t = Prog; Prog = v[CO_PROG]; v[CO_PROG] = t;
+	t = Ep;   Ep = v[CO_EP];     v[CO_EP] = t;
+	r = coregs(c);
+	i = Sz; Sz = r[CR_SZ]; r[CR_SZ] = i;
+	i = Sp; Sp = r[CR_SP]; r[CR_SP] = i;
+	i = Fp; Fp = r[CR_FP]; r[CR_FP] = i;
+	i = Ip; Ip = r[CR_IP]; r[CR_IP] = i;
+	for (i=0; i<3; i++) {
+		if (NIL == Dynbox[i]) {
+			b = assq(*dyn[i], Glob);
+			if (NIL == b) continue;
+			Dynbox[i] = cdr(b);
+		}
+		t = car(Dynbox[i]);
+		car(Dynbox[i]) = v[CO_DYN+i];
+		v[CO_DYN+i] = t;
+	}
+}
+
+void resume(cell c, cell x) {
+	int	*r;
+
+	if (!coroutinep(c)) expect("resume", "coroutine", c);
+	r = coregs(c);
+	if (CS_RUNNING == r[CR_STATE])
+		error("resume: coroutine is running", c);
+	if (CS_DEAD == r[CR_STATE])
+		error("resume: coroutine is dead", c);
+	clear(1);
+	skip(ISIZE0);
+	Acc = CS_WAITING == r[CR_STATE]? coslots(c)[CO_ACC]: x;
+	r[CR_STATE] = CS_RUNNING;
+	r[CR_DEPTH] = Rdepth;
+	coslots(c)[CO_ACC] = NIL;
+	coslots(c)[CO_CALLER] = Cur;
+	Cur = c;
+	coswap(c);
+}
+
+void cosuspend(int state) {
+	cell	c;
+
+	c = Cur;
+	coregs(c)[CR_STATE] = state;
+	coswap(c);
+	Cur = coslots(c)[CO_CALLER];
+	coslots(c)[CO_CALLER] = NIL;
+}
+
+int coactive(void) {
+	return Cur != NIL && coregs(Cur)[CR_DEPTH] == Rdepth;
+}
+
+void yield(void) {
+	if (NIL == Cur) error("yield: not in a coroutine", UNDEF);
+	if (!coactive())
+		error("yield: cannot yield across EVAL or LOAD", UNDEF);
+	skip(ISIZE0);
+	cosuspend(CS_SUSPENDED);
+}
+
+void coend(void) {
+	cell	c, *v;
+
+	c = Cur;
+	cosuspend(CS_DEAD);
+	v = coslots(c);
+	v[CO_RTS] = v[CO_PROG] = v[CO_EP] = NIL;
+}
+
+/*
+ * Suspend the running coroutine, if PORT would block.
+ * The current instruction is not skipped, so it will be
+ * retried when the coroutine is resumed.
+ */
+
+int cowait(cell port) {
+	if (NIL == port || !coactive()) return 0;
+	coslots(Cur)[CO_ACC] = Acc;
+	cosuspend(CS_WAITING);
+	Acc = port;
+	return 1;
+}
+
+#define blocked(p, port) \
+	(Port_flags[p] & PAGAIN_TAG? (port): NIL)
+
+cell blockedport(cell o, cell x, cell y) {
+	if (!fixp(o)) return NIL;
+	if (POP_READ == fixval(o) && inportp(y))
+		return blocked(portno(y), y);
+	if (POP_ACCEPT == fixval(o) && inportp(x))
+		return blocked(portno(x), x);
+	return NIL;
+}
+
+cell costate(cell c) {
+	if (!coroutinep(c)) expect("coroutine-state", "coroutine", c);
+	switch (coregs(c)[CR_STATE]) {
+	case CS_SUSPENDED:	return S_suspended;
+	case CS_RUNNING:	return S_running;
+	case CS_WAITING:	return S_waiting;
+	default:		return S_dead;
+	}
+}
+
+/*
+ * A catch tag records the coroutine and the nesting level of
+ * RUN() in which it was created. Throwing to a catch tag of an
+ * outer level (e.g. out of EVAL) leaves the inner levels through
+ * their jmp_bufs, which are chained through the local OUTER
+ * pointers of RUN().
+ */
+
+int colevel(void) {
+	return NIL == Cur? Rdepth: Rdepth - coregs(Cur)[CR_DEPTH];
+}
+
 cell mkctag(void) {
 	cell	n;
 
 	n = cons(Ep, Prog);
+	Tmp = n; n = cons(mkfix(colevel()), n);
+	Tmp = n; n = cons(Cur, n);
 	Tmp = n; n = cons(mkfix(Fp), n);
 	Tmp = n; n = cons(mkfix(Sp), n);
 	Tmp = n; n = cons(mkfix(Ip+2), n);
@@ -4574,33 +9235,48 @@ cell mkctag(void) {
 
 int throw(cell ct, cell v) {
 	if (!ctagp(ct)) expect("throw", "catch tag", ct);
+	if (ctag_co(ct) != Cur)
+		error("throw: catch tag belongs to another coroutine", UNDEF);
+	if (ctag_level(ct) < colevel()) {
+		Handler = ct;
+		Throwval = v;
+		longjmp(*Errtag, 1);
+	}
 	ct = cdr(ct);
 	Ip = fixval(car(ct)); ct = cdr(ct);
 	Sp = fixval(car(ct)); ct = cdr(ct);
-	Fp = fixval(car(ct)); ct = cdr(ct);
+	Fp = fixval(car(ct)); ct = cdddr(ct);
 	Ep = car(ct);         ct = cdr(ct);
 	Prog = ct;
 	Acc = v;
 	return Ip;
 }
 
-int throwerr(cell ct) {
-	cell	n;
-
-	n = assq(S_errval, Glob);
-	n = NIL == n? NIL: cadr(n);
-	return throw(ct, n);
-}
-
-volatile int	Run = 0;
-cell	Argv;
+THREAD volatile int	Run = 0;
+THREAD cell	Argv;
 
 void run(cell x) {
+	cell	n, prot;
+	int	depth;
+	jmp_buf	here, *outer;
+
+	outer = Errtag;
+	Errtag = &here;
+	prot = Protected;
+	depth = ++Rdepth;
 	Acc = NIL;
 	Prog = x;
 	Ip = 0;
-	if (setjmp(Errtag) != 0)
-		Ip = throwerr(Handler);
+	if (setjmp(here) != 0) {
+		Rdepth = depth;
+		if (ctagp(Handler) && ctag_level(Handler) < colevel()) {
+			Rdepth--;
+			Errtag = outer;
+			longjmp(*Errtag, 1);
+		}
+		Protected = prot;
+		Ip = throw(Handler, Throwval);
+	}
 	for (Run=1; Run;) {
 	switch (ins()) {
 	case OP_APPLIS:
@@ -4668,6 +9344,8 @@ void run(cell x) {
 			Ip = op1();
 		break;
 	case OP_HALT:
+		Rdepth--;
+		Errtag = outer;
 		return;
 	case OP_CATCHSTAR:
 		push(box(mkctag()));
@@ -4740,11 +9418,13 @@ void run(cell x) {
 		skip(ISIZE0);
 		break;
 	case OP_ERROR:
+		Acc = unslice(Acc);
 		if (!stringp(Acc)) expect("error", "string", Acc);
 		error((char *) string(Acc), UNDEF);
 		skip(ISIZE0);
 		break;
 	case OP_ERROR2:
+		Acc = unslice(Acc);
 		if (!stringp(Acc)) expect("error", "string", Acc);
 		error((char *) string(Acc), arg(0));
 		clear(1);
@@ -4775,7 +9455,7 @@ void run(cell x) {
 			Acc = mkfloat(fabs(floatval(Acc)));
 		} else {
 			if (!fixp(Acc)) expect("abs", "number", Acc);
-			if (INT_MIN == fixval(Acc))
+			if (CELL_MIN == fixval(Acc))
 				error("abs: fixnum overflow", Acc);
 			if (fixval(Acc) < 0) Acc = mkfix(-fixval(Acc));
 		}
@@ -4855,7 +9535,12 @@ void run(cell x) {
 		Acc = ctagp(Acc)? TRUE: NIL;
 		skip(ISIZE0);
 		break;
+	case OP_DESERIALIZE:
+		Acc = deserialize(Acc);
+		skip(ISIZE0);
+		break;
 	case OP_DELETE:
+		Acc = unslice(Acc);
 		if (!stringp(Acc)) expect("delete", "string", Acc);
 		if (remove((char *) string(Acc)) < 0)
 			error("delete: cannot delete", Acc);
@@ -4867,10 +9552,27 @@ void run(cell x) {
 		Acc = mkchar(tolower(charval(Acc)));
 		skip(ISIZE0);
 		break;
+	case OP_DUMP_DELTA:
+		Acc = unslice(Acc);
+		if (!stringp(Acc)) expect("dump-delta", "string", Acc);
+		dump_delta(Acc);
+		Acc = TRUE;
+		skip(ISIZE0);
+		break;
 	case OP_DUMP_IMAGE:
+		Acc = unslice(Acc);
 		if (!stringp(Acc)) expect("dump-image", "string", Acc);
-		dump_image(Acc);
+		dump_image(Acc, arg(0));
+		Acc = TRUE;
+		clear(1);
+		skip(ISIZE0);
+		break;
+	case OP_DUMP_EXEC:
+		Acc = unslice(Acc);
+		if (!stringp(Acc)) expect("dump-executable", "string", Acc);
+		dump_exec(Acc, arg(0));
 		Acc = TRUE;
+		clear(1);
 		skip(ISIZE0);
 		break;
 	case OP_EOFP:
@@ -4882,6 +9584,7 @@ void run(cell x) {
 		skip(ISIZE0);
 		break;
 	case OP_EXISTSP:
+		Acc = unslice(Acc);
 		if (!stringp(Acc)) expect("existsp", "string", Acc);
 		Acc = existsp((char *) string(Acc));
 		skip(ISIZE0);
@@ -4892,7 +9595,8 @@ void run(cell x) {
 		break;
 	case OP_FLUSH:
 		if (!outportp(Acc)) expect("flush", "outport", Acc);
-		fflush(Ports[portno(Acc)]);
+		if (flushport(portno(Acc)) < 0)
+			error("file write error, port", Acc);
 		skip(ISIZE0);
 		break;
 	case OP_FORMAT:
@@ -4907,6 +9611,55 @@ void run(cell x) {
 		Acc = inportp(Acc)? TRUE: NIL;
 		skip(ISIZE0);
 		break;
+	case OP_COROUTINE:
+		Acc = mkcoroutine(Acc);
+		skip(ISIZE0);
+		break;
+	case OP_RESUME:
+		resume(Acc, arg(0));
+		break;
+	case OP_YIELD:
+		yield();
+		break;
+	case OP_COEND:
+		coend();
+		break;
+	case OP_COSTATE:
+		Acc = costate(Acc);
+		skip(ISIZE0);
+		break;
+	case OP_ISOLATE:
+		if (!closurep(Acc)) expect("isolate", "function", Acc);
+		Acc = isolate(Acc, 0);
+		skip(ISIZE0);
+		break;
+	case OP_SPAWN:
+		if (!closurep(Acc)) expect("spawn", "function", Acc);
+		Acc = isolate(Acc, 1);
+		skip(ISIZE0);
+		break;
+	case OP_MKCHANNEL:
+		Acc = mkchannel(Acc);
+		skip(ISIZE0);
+		break;
+	case OP_CHANSEND:
+		Acc = chansend(Acc, arg(0));
+		clear(1);
+		skip(ISIZE0);
+		break;
+	case OP_CHANRECV:
+		Acc = chanrecv(Acc);
+		skip(ISIZE0);
+		break;
+	case OP_CHANCLOSE:
+		Acc = chanclose(Acc);
+		skip(ISIZE0);
+		break;
+	case OP_ISOLATE_WAIT:
+		if (!fixp(Acc)) expect("isolate-wait", "fixnum", Acc);
+		Acc = isolate_wait(Acc);
+		skip(ISIZE0);
+		break;
 	case OP_LISTSTR:
 		if (!listp(Acc)) expect("liststr", "list", Acc);
 		Acc = liststr(Acc);
@@ -4922,6 +9675,10 @@ void run(cell x) {
 		Acc = TRUE;
 		skip(ISIZE0);
 		break;
+	case OP_COMPILE_FILE:
+		Acc = compfile(Acc);
+		skip(ISIZE0);
+		break;
 	case OP_LOWERC:
 		if (!charp(Acc)) expect("lowerc", "char", Acc);
 		Acc = islower(charval(Acc))? TRUE: NIL;
@@ -4940,7 +9697,7 @@ void run(cell x) {
 			Acc = mkfloat(-floatval(Acc));
 		} else {
 			if (!fixp(Acc)) expect("-", "number", Acc);
-			if (INT_MIN == fixval(Acc))
+			if (CELL_MIN == fixval(Acc))
 				error("-: fixnum overflow", Acc);
 			Acc = mkfix(-fixval(Acc));
 		}
@@ -4970,11 +9727,13 @@ void run(cell x) {
 		skip(ISIZE0);
 		break;
 	case OP_OPEN_INFILE:
+		Acc = unslice(Acc);
 		if (!stringp(Acc)) expect("open-infile", "string", Acc);
 		Acc = openfile(Acc, 0);
 		skip(ISIZE0);
 		break;
 	case OP_OPEN_OUTFILE:
+		Acc = unslice(Acc);
 		if (!stringp(Acc)) expect("open-outfile", "string", Acc);
 		Acc = openfile(Acc, NIL == arg(0)? 1: 2);
 		clear(1);
@@ -4990,18 +9749,30 @@ void run(cell x) {
 		break;
 	case OP_PEEKC:
 		if (!inportp(Acc)) expect("peekc", "inport", Acc);
-		Acc = b_readc(portno(Acc), 1);
+		n = b_readc(portno(Acc), 1);
+		if (NIL == n && cowait(blocked(portno(Acc), Acc))) break;
+		Acc = n;
 		skip(ISIZE0);
 		break;
 	case OP_READ:
+		Acc = unslice(Acc);
 		if (!inportp(Acc) && !stringp(Acc))
 			expect("read", "inport", Acc);
 		Acc = b_read(Acc);
 		skip(ISIZE0);
 		break;
+	case OP_READLN:
+		if (!inportp(Acc)) expect("readln", "inport", Acc);
+		n = b_readln(portno(Acc));
+		if (NIL == n && cowait(blocked(portno(Acc), Acc))) break;
+		Acc = n;
+		skip(ISIZE0);
+		break;
 	case OP_READC:
 		if (!inportp(Acc)) expect("readc", "inport", Acc);
-		Acc = b_readc(portno(Acc), 0);
+		n = b_readc(portno(Acc), 0);
+		if (NIL == n && cowait(blocked(portno(Acc), Acc))) break;
+		Acc = n;
 		skip(ISIZE0);
 		break;
 	case OP_CONC:
@@ -5027,11 +9798,12 @@ void run(cell x) {
 		skip(ISIZE0);
 		break;
 	case OP_SSIZE:
-		if (!stringp(Acc)) expect("ssize", "string", Acc);
-		Acc = mkfix(stringlen(Acc)-1);
+		if (!anystrp(Acc)) expect("ssize", "string", Acc);
+		Acc = mkfix(strsize(Acc));
 		skip(ISIZE0);
 		break;
 	case OP_STRNUM:
+		Acc = unslice(Acc);
 		if (!stringp(Acc)) expect("strnum", "string", Acc);
 		if (!fixp(arg(0))) expect("strnum", "fixnum", arg(0));
 		Acc = strnum((char *) string(Acc), fixval(arg(0)));
@@ -5043,6 +9815,7 @@ void run(cell x) {
 		skip(ISIZE0);
 		break;
 	case OP_SYMBOL:
+		Acc = unslice(Acc);
 		if (!stringp(Acc)) expect("symbol", "string", Acc);
 		Acc = b_symbol(Acc);
 		skip(ISIZE0);
@@ -5053,16 +9826,18 @@ void run(cell x) {
 		skip(ISIZE0);
 		break;
 	case OP_STRINGP:
-		Acc = stringp(Acc)? TRUE: NIL;
+		Acc = anystrp(Acc)? TRUE: NIL;
 		skip(ISIZE0);
 		break;
 	case OP_STRLIST:
-		if (!stringp(Acc)) expect("strlist", "string", Acc);
+		if (!anystrp(Acc)) expect("strlist", "string", Acc);
 		Acc = strlist(Acc);
 		skip(ISIZE0);
 		break;
 	case OP_SYSCMD:
+		Acc = unslice(Acc);
 		if (!stringp(Acc)) expect("syscmd", "string", Acc);
+		flush_ports();
 		Acc = mkfix(system((char *) string(Acc)) >> 8);
 		skip(ISIZE0);
 		break;
@@ -5085,17 +9860,17 @@ void run(cell x) {
 		skip(ISIZE0);
 		break;
 	case OP_VECLIST:
-		if (!vectorp(Acc)) expect("veclist", "vector", Acc);
+		if (!anyvecp(Acc)) expect("veclist", "vector", Acc);
 		Acc = veclist(Acc);
 		skip(ISIZE0);
 		break;
 	case OP_VECTORP:
-		Acc = vectorp(Acc)? TRUE: NIL;
+		Acc = anyvecp(Acc)? TRUE: NIL;
 		skip(ISIZE0);
 		break;
 	case OP_VSIZE:
-		if (!vectorp(Acc)) expect("vsize", "vector", Acc);
-		Acc = mkfix(veclen(Acc));
+		if (!anyvecp(Acc)) expect("vsize", "vector", Acc);
+		Acc = mkfix(vecitems(Acc));
 		skip(ISIZE0);
 		break;
 	case OP_WHITEC:
@@ -5330,6 +10105,69 @@ void run(cell x) {
 		clear(2);
 		skip(ISIZE0);
 		break;
+	case OP_ARRAYOP:
+		Acc = arrayop(Acc, arg(0), arg(1));
+		clear(2);
+		skip(ISIZE0);
+		break;
+	case OP_PORTOP:
+		n = portop(Acc, arg(0), arg(1));
+		if (NIL == n && cowait(blockedport(Acc, arg(0), arg(1))))
+			break;
+		Acc = n;
+		clear(2);
+		skip(ISIZE0);
+		break;
+	case OP_SERIALIZE:
+		Acc = serialize(Acc, arg(0));
+		clear(1);
+		skip(ISIZE0);
+		break;
+	case OP_ASET:
+		aset(Acc, arg(0), arg(1));
+		clear(2);
+		skip(ISIZE0);
+		break;
+	case OP_SETBUFMODE:
+		Acc = setbufmode(Acc, arg(0));
+		clear(1);
+		skip(ISIZE0);
+		break;
+	case OP_SFIELDS:
+		Acc = strsplit(Acc, arg(0), 1);
+		clear(1);
+		skip(ISIZE0);
+		break;
+	case OP_SSPLIT:
+		Acc = strsplit(Acc, arg(0), 0);
+		clear(1);
+		skip(ISIZE0);
+		break;
+	case OP_SCOUNT:
+		Acc = strcount(Acc, arg(0));
+		clear(1);
+		skip(ISIZE0);
+		break;
+	case OP_SINDEX:
+		Acc = strindex(Acc, arg(0));
+		clear(1);
+		skip(ISIZE0);
+		break;
+	case OP_SSEARCH:
+		Acc = strsearch(Acc, arg(0), 0);
+		clear(1);
+		skip(ISIZE0);
+		break;
+	case OP_SSEARCHCI:
+		Acc = strsearch(Acc, arg(0), 1);
+		clear(1);
+		skip(ISIZE0);
+		break;
+	case OP_SLICE:
+		Acc = slice(Acc, arg(0), arg(1));
+		clear(2);
+		skip(ISIZE0);
+		break;
 	case OP_SUBSTR:
 		Acc = substr(Acc, arg(0), arg(1));
 		clear(2);
@@ -5360,6 +10198,24 @@ void run(cell x) {
 		clear(2);
 		skip(ISIZE0);
 		break;
+	case OP_READBLK:
+		if (!inportp(arg(0))) expect("read-block", "inport", arg(0));
+		n = readblock(Acc, portno(arg(0)), T_STRING);
+		if (NIL == n && cowait(blocked(portno(arg(0)), arg(0))))
+			break;
+		Acc = n;
+		clear(1);
+		skip(ISIZE0);
+		break;
+	case OP_WRITEBLK:
+		if (!anystrp(Acc)) expect("write-block", "string", Acc);
+		if (!outportp(arg(0)))
+			expect("write-block", "outport", arg(0));
+		writeport(portno(arg(0)), (char *) strdata(Acc),
+			strsize(Acc));
+		clear(1);
+		skip(ISIZE0);
+		break;
 	case OP_WRITEC:
 		if (!charp(Acc)) expect("writec", "char", Acc);
 		if (!outportp(arg(0))) expect("writec", "outport", arg(0));
@@ -5384,9 +10240,9 @@ void run(cell x) {
 		if (!floatp(Acc)) expect("float->fixnum", "float", Acc);
 		{
 			double d = floatval(Acc);
-			if (d > INT_MAX || d < INT_MIN)
+			if (d >= CELL_MAX + 1.0 || d < CELL_MIN)
 				error("float->fixnum: overflow", Acc);
-			Acc = mkfix((int) d);
+			Acc = mkfix((cell) d);
 		}
 		skip(ISIZE0);
 		break;
@@ -5472,14 +10328,14 @@ void run(cell x) {
 		if (!numberp(Acc)) expect("expt", "number", Acc);
 		if (!numberp(arg(0))) expect("expt", "number", arg(0));
 		if (fixp(Acc) && fixp(arg(0)) && fixval(arg(0)) >= 0) {
-			int base = fixval(Acc);
-			int exp = fixval(arg(0));
-			int result = 1;
+			cell base = fixval(Acc);
+			cell exp = fixval(arg(0));
+			cell result = 1;
 			int ok = 1;
 			while (exp > 0) {
 				if (exp & 1) {
 					if (base != 0 &&
-					    abs(result) > INT_MAX / abs(base))
+					    cellabs(result) > CELL_MAX / cellabs(base))
 					{
 						ok = 0;
 						break;
@@ -5489,7 +10345,7 @@ void run(cell x) {
 				exp >>= 1;
 				if (exp > 0) {
 					if (base != 0 &&
-					    abs(base) > INT_MAX / abs(base))
+					    cellabs(base) > CELL_MAX / cellabs(base))
 					{
 						ok = 0;
 						break;
@@ -5509,6 +10365,16 @@ void run(cell x) {
 		clear(1);
 		skip(ISIZE0);
 		break;
+	case OP_OPEN_OUTSTR:
+		Acc = openstring();
+		skip(ISIZE0);
+		break;
+	case OP_GET_OUTSTR:
+		if (!strportp(Acc))
+			expect("get-output-string", "string outport", Acc);
+		Acc = strport_string(portno(Acc));
+		skip(ISIZE0);
+		break;
 	default:
 		error("illegal instruction", mkfix(ins()));
 		return;
@@ -5566,7 +10432,7 @@ cell eval(cell x, int r) {
  * REPL
  */
 
-volatile int	Intr = 0;
+THREAD volatile int	Intr = 0;
 
 void kbdintr(int sig) {
 	Run = 0;
@@ -5574,7 +10440,7 @@ void kbdintr(int sig) {
 	Mxlev = -1;
 }
 
-int	Quiet = 0;
+THREAD int	Quiet = 0;
 
 void initrts(void) {
 	Rts = NIL;
@@ -5582,6 +10448,12 @@ void initrts(void) {
 	Sz = CHUNKSIZE;
 	Sp = -1;
 	Fp = -1;
+	while (Cur != NIL) {
+		coregs(Cur)[CR_STATE] = CS_DEAD;
+		Cur = coslots(Cur)[CO_CALLER];
+	}
+	Rdepth = 0;
+	Errtag = NULL;
 }
 
 void repl(void) {
@@ -5616,16 +10488,32 @@ void repl(void) {
  * Startup and initialization
  */
 
-void init(void) {
+void initsyms(void);
+
+void initports(void) {
 	int	i;
 
-	for (i=2; i<NPORTS; i++) Ports[i] = NULL;
-	Ports[0] = stdin;  Port_flags[0] = LOCK_TAG;
-	Ports[1] = stdout; Port_flags[1] = LOCK_TAG;
-	Ports[2] = stderr; Port_flags[2] = LOCK_TAG;
+	grow_ports();
+	for (i=0; i<3; i++) {
+		newport();
+		Port_fd[i] = i;
+		Port_buf[i] = malloc(PORTBUFSIZE);
+		if (NULL == Port_buf[i])
+			fatal("init: out of physical memory");
+		Port_pos[i] = Port_lim[i] = 0;
+		Port_size[i] = PORTBUFSIZE;
+	}
+	Port_flags[0] = LOCK_TAG;
+	Port_flags[1] = LOCK_TAG | POUT_TAG | (isatty(1)? PLINE_TAG: 0);
+	Port_flags[2] = LOCK_TAG | POUT_TAG | PLINE_TAG;
+}
+
+void init(void) {
+	initroots();
+	initports();
+	atexit(flush_ports);
 	alloc_nodepool();
 	alloc_vecpool();
-	gcv();
 	initrts();
 	clrtrace();
 	Nullvec = newvec(T_VECTOR, 0);
@@ -5640,6 +10528,23 @@ void init(void) {
 	Obarray = mkvec(CHUNKSIZE);
 	Obmap = mkstr("", CHUNKSIZE);
 	memset(string(Obmap), OBFREE, CHUNKSIZE);
+	initsyms();
+	bindnew(S_errtag, NIL);
+	bindnew(S_errval, NIL);
+	bindnew(S_imagefile, NIL);
+	bindnew(S_program, NIL);
+	bindnew(S_quiet, NIL);
+	bindnew(S_starstar, NIL);
+	bindnew(S_start, NIL);
+}
+
+/*
+ * Bind the symbols used by the interpreter. This is done again
+ * after loading an image, because the nodes of the image are not
+ * the nodes created by init().
+ */
+
+void initsyms(void) {
 	symref("?");
 	I_a = symref("a");
 	I_e = symref("e");
@@ -5659,15 +10564,32 @@ void init(void) {
 	S_lambda = symref("lambda");
 	S_macro = symref("macro");
 	S_prog = symref("prog");
+	S_program = symref("*program*");
 	S_quiet = symref("*quiet*");
 	S_quote = symref("quote");
 	S_qquote = symref("qquote");
 	S_unquote = symref("unquote");
+	S_unwind = symref("*unwind*");
+	S_dead = symref("dead");
+	S_running = symref("running");
+	S_suspended = symref("suspended");
+	S_waiting = symref("waiting");
+	Dynbox[0] = Dynbox[1] = Dynbox[2] = NIL;
 	S_splice = symref("splice");
 	S_starstar = symref("**");
 	S_setq = symref("setq");
+	S_f64 = symref("f64");
+	S_full = symref("full");
+	S_tcp = symref("tcp");
+	S_unix = symref("unix");
+	S_line = symref("line");
+	S_none = symref("none");
+	S_s32 = symref("s32");
+	S_u8 = symref("u8");
 	S_start = symref("start");
 	P_abs = symref("abs");
+	P_arrayop = symref("arrayop");
+	P_aset = symref("aset");
 	P_acos = symref("acos");
 	P_asin = symref("asin");
 	P_atan = symref("atan");
@@ -5691,16 +10613,25 @@ void init(void) {
 	P_charp = symref("charp");
 	P_charval = symref("charval");
 	P_cless = symref("c<");
+	P_chanclose = symref("channel-close");
+	P_chanrecv = symref("channel-receive");
+	P_chansend = symref("channel-send");
 	P_close_port = symref("close-port");
 	P_clteq = symref("c<=");
 	P_cmdline = symref("cmdline");
 	P_conc = symref("conc");
+	P_compile_file = symref("compile-file");
 	P_cons = symref("cons");
 	P_constp = symref("constp");
+	P_coroutinestar = symref("coroutine*");
+	P_costate = symref("coroutine-state");
 	P_ctagp = symref("ctagp");
 	P_delete = symref("delete");
+	P_deserialize = symref("deserialize");
 	P_div = symref("div");
 	P_downcase = symref("downcase");
+	P_dump_delta = symref("dump-delta");
+	P_dump_exec = symref("dump-executable");
 	P_dump_image = symref("dump-image");
 	P_eofp = symref("eofp");
 	P_eq = symref("eq");
@@ -5721,10 +10652,13 @@ void init(void) {
 	P_funp = symref("funp");
 	P_gc = symref("gc");
 	P_gensym = symref("gensym");
+	P_get_outstr = symref("get-output-string");
 	P_grtr = symref(">");
 	P_gteq = symref(">=");
 	P_inport = symref("inport");
 	P_inportp = symref("inportp");
+	P_isolate = symref("isolate");
+	P_isolate_wait = symref("isolate-wait");
 	P_less = symref("<");
 	P_liststr = symref("liststr");
 	P_listvec = symref("listvec");
@@ -5732,6 +10666,7 @@ void init(void) {
 	P_log = symref("log");
 	P_lowerc = symref("lowerc");
 	P_lteq = symref("<=");
+	P_mkchannel = symref("make-channel");
 	P_max = symref("max");
 	P_min = symref("min");
 	P_minus = symref("-");
@@ -5749,26 +10684,35 @@ void init(void) {
 	P_obtab = symref("obtab");
 	P_open_infile = symref("open-infile");
 	P_open_outfile = symref("open-outfile");
+	P_open_outstr = symref("open-outstring");
 	P_outport = symref("outport");
 	P_outportp = symref("outportp");
 	P_pair = symref("pair");
 	P_peekc = symref("peekc");
 	P_plus = symref("+");
+	P_portop = symref("portop");
 	P_prin = symref("prin");
 	P_princ = symref("princ");
 	P_quit = symref("quit");
+	P_readblk = symref("read-block");
+	P_readline = symref("read-line");
+	P_readln = symref("readln");
 	P_read = symref("read");
 	P_readc = symref("readc");
 	P_reconc = symref("reconc");
 	P_rem = symref("rem");
 	P_rename = symref("rename");
+	P_resumestar = symref("resume*");
 	P_round = symref("round");
 	P_sin = symref("sin");
+	P_spawn = symref("spawn");
 	P_sqrt = symref("sqrt");
 	P_sconc = symref("sconc");
 	P_sequal = symref("s=");
+	P_serialize = symref("serialize");
 	P_set_inport = symref("set-inport");
 	P_set_outport = symref("set-outport");
+	P_setbufmode = symref("set-buffer-mode");
 	P_setcar = symref("setcar");
 	P_setcdr = symref("setcdr");
 	P_sfill = symref("sfill");
@@ -5782,11 +10726,18 @@ void init(void) {
 	P_sless = symref("s<");
 	P_slteq = symref("s<=");
 	P_sref = symref("sref");
+	P_scount = symref("string-count");
+	P_sfields = symref("string-fields");
+	P_sindex = symref("string-index");
+	P_ssplit = symref("string-split");
+	P_ssearch = symref("string-search");
+	P_ssearchci = symref("string-search-ci");
 	P_sset = symref("sset");
 	P_ssize = symref("ssize");
 	P_stringp = symref("stringp");
 	P_strlist = symref("strlist");
 	P_strnum = symref("strnum");
+	P_slice = symref("slice");
 	P_substr = symref("substr");
 	P_subvec = symref("subvec");
 	P_symbol = symref("symbol");
@@ -5808,13 +10759,9 @@ void init(void) {
 	P_vset = symref("vset");
 	P_vsize = symref("vsize");
 	P_whitec = symref("whitec");
+	P_writeblk = symref("write-block");
 	P_writec = symref("writec");
-	bindnew(S_errtag, NIL);
-	bindnew(S_errval, NIL);
-	bindnew(S_imagefile, NIL);
-	bindnew(S_quiet, NIL);
-	bindnew(S_starstar, NIL);
-	bindnew(S_start, NIL);
+	P_yieldstar = symref("yield*");
 }
 
 void start(void) {
@@ -5828,24 +10775,35 @@ void start(void) {
 	eval(n, 0);
 }
 
-cell	*Imagevars[] = {
-		&Freelist, &Freevec, &Symbols, &Symhash, &Symptr,
-		&Rts, &Glob, &Macros, &Obhash, &Obarray, &Obmap,
-		&Defined, NULL };
+/*
+ * The addresses of thread-local variables are not constant,
+ * so the root tables of each isolate are filled in at run time.
+ */
+
+void initroots(void) {
+	cell	**v;
 
-cell	*GC_roots[] = {
-		&Protected, &Symbols, &Symhash, &Prog, &Env, &Defined, &Obhash,
-		&Obarray, &Obmap, &Cts, &Emitbuf, &Glob, &Macros, &Rts,
-		&Acc, &E0, &Ep, &Argv, &Tmp, &Tmp_car, &Tmp_cdr, &Files,
-		&Outstr, &Nullvec, &Nullstr, &Blank, &Zero, &One, &Ten,
-		NULL };
+	v = Imagevars;
+	*v++ = &Symbols; *v++ = &Symhash; *v++ = &Glob; *v++ = &Macros;
+	*v++ = &Obhash; *v++ = &Obarray; *v++ = &Obmap; *v++ = &Defined;
+	*v++ = &Nullvec; *v++ = &Nullstr; *v++ = &Blank; *v++ = &Zero;
+	*v++ = &One; *v++ = &Ten; *v = NULL;
+	v = GC_roots;
+	*v++ = &Protected; *v++ = &Symbols; *v++ = &Symhash; *v++ = &Prog;
+	*v++ = &Env; *v++ = &Defined; *v++ = &Obhash; *v++ = &Obarray;
+	*v++ = &Obmap; *v++ = &Cts; *v++ = &Emitbuf; *v++ = &Glob;
+	*v++ = &Macros; *v++ = &Rts; *v++ = &Acc; *v++ = &E0; *v++ = &Ep;
+	*v++ = &Argv; *v++ = &Tmp; *v++ = &Tmp_car; *v++ = &Tmp_cdr;
+	*v++ = &Files; *v++ = &Nullvec; *v++ = &Nullstr; *v++ = &Blank;
+	*v++ = &Zero; *v++ = &One; *v++ = &Ten; *v++ = &Cur; *v = NULL;
+}
 
 /*
  * Command line interface
  */
 
 void usage(void) {
-	prints("Usage: ls9 [-Lhqv?] [-i file | -] [-l file]\n");
+	prints("Usage: ls9 [-Lhqv?] [-i file | -] [-l file] [-S path]\n");
 	prints("           [-- argument ... | file argument ...]\n");
 }
 
@@ -5864,8 +10822,12 @@ void longusage(void) {
 		"           (-i must be the first option!)\n");
 	prints(	"-l file    load program from file, can be repeated\n"
 		"-q         quiet (no banner, no prompt, exit on errors)\n"
+		"-S path    serve requests on Unix socket (must be last)\n"
 		"-- args    bind remaining arguments to (cmdline)\n"
 		"file args  run program, args in (cmdline), implies -q\n"
+		"\n"
+		"ls9 -C path [option ...] [file args]\n"
+		"           run command line on server at path (-S)\n"
 		"\n");
 	exit(EXIT_SUCCESS);
 }
@@ -5892,7 +10854,7 @@ char *cmdarg(char *s) {
 	return s;
 }
 
-cell	Argv = NIL;
+THREAD cell	Argv = NIL;
 
 cell argvec(char **argv) {
 	int	i;
@@ -5913,38 +10875,324 @@ cell argvec(char **argv) {
 	return unprot(1);
 }
 
-int main(int argc, char **argv) {
-	int	i, j, k, usrimg, doload;
-	char	*s;
-	char	*imgfile;
+/*
+ * Zygote server
+ *
+ * With -S path, LISP9 loads its image and any files given with -l
+ * once and then serves requests on the Unix socket PATH. LISP9
+ * started with -C path is a client, which sends its own command
+ * line to the server at PATH without initializing the interpreter.
+ *
+ * A request starts with a header consisting of ZYGMAGIC and the
+ * length of the request data in hex. The header carries the
+ * descriptors 0, 1, and 2 of the client in an SCM_RIGHTS message.
+ * The data consists of the number of arguments, the arguments,
+ * the working directory, and the environment of the client, as
+ * NUL-terminated strings. For each request the server forks a
+ * child, which forks a worker that runs the command line on the
+ * client's descriptors, like LISP9 would. The child then sends
+ * the exit status of the worker to the client in decimal.
+ *
+ * The socket is accessible only to its owner and, where the
+ * system can tell, requests from other users are refused. When
+ * the client receives SIGINT, it sends ZYGINTR to the child,
+ * which passes the signal on to the worker.
+ */
 
-	imgfile = IMAGEFILE;
-	usrimg = 0;
-	doload = 1;
-	if (setjmp(Restart) != 0) exit(EXIT_FAILURE);
-	init();
-	i = 1;
-	if (argc > 2 && strcmp(argv[1], "-i") == 0) {
-		imgfile = argv[2];
-		i = 3;
-		usrimg = 1;
+#define ZYGMAGIC	"L9ZY"
+#define ZYGHDR		12
+#define ZYGINTR		'I'
+
+void	ls9main(char **argv, int i);
+
+int readall(int fd, char *s, int k) {
+	int	n;
+
+	while (k > 0) {
+		n = read(fd, s, k);
+		if (n < 0 && EINTR == errno) continue;
+		if (n <= 0) return -1;
+		s += n;
+		k -= n;
+	}
+	return 0;
+}
+
+int zrecv(int c, char *hdr, int *fds) {
+	struct msghdr	m;
+	struct iovec	io;
+	struct cmsghdr	*cm;
+	union {
+		struct cmsghdr	h;
+		char		b[CMSG_SPACE(3 * sizeof(int))];
+	}		cb;
+	int		n;
+
+	memset(&m, 0, sizeof(m));
+	io.iov_base = hdr;
+	io.iov_len = ZYGHDR;
+	m.msg_iov = &io;
+	m.msg_iovlen = 1;
+	m.msg_control = cb.b;
+	m.msg_controllen = sizeof(cb.b);
+	while ((n = recvmsg(c, &m, 0)) < 0 && EINTR == errno)
+		;
+	if (n <= 0) return -1;
+	cm = CMSG_FIRSTHDR(&m);
+	if (	NULL == cm ||
+		cm->cmsg_level != SOL_SOCKET ||
+		cm->cmsg_type != SCM_RIGHTS ||
+		cm->cmsg_len != CMSG_LEN(3 * sizeof(int))
+	)
+		return -1;
+	memcpy(fds, CMSG_DATA(cm), 3 * sizeof(int));
+	if (n < ZYGHDR && readall(c, hdr+n, ZYGHDR-n) < 0)
+		return -1;
+	return memcmp(hdr, ZYGMAGIC, 4)? -1: 0;
+}
+
+int zpeerok(int c) {
+#ifdef SO_PEERCRED
+	struct ucred	cr;
+	socklen_t	k;
+
+	k = sizeof(cr);
+	if (getsockopt(c, SOL_SOCKET, SO_PEERCRED, &cr, &k) < 0)
+		return 0;
+	return cr.uid == geteuid();
+#else
+	return 1;
+#endif
+}
+
+void zygote(int c) {
+	char		hdr[ZYGHDR+1], *buf, *p, *end, **av, **ev, *cwd,
+			b[20];
+	int		fds[3], i, k, ac, st;
+	pid_t		pid;
+	struct pollfd	pfd;
+
+	signal(SIGCHLD, SIG_DFL);
+	if (!zpeerok(c)) _exit(EXIT_FAILURE);
+	if (zrecv(c, hdr, fds) < 0) _exit(EXIT_FAILURE);
+	hdr[ZYGHDR] = 0;
+	k = (int) strtol(&hdr[4], NULL, 16);
+	if (k < 1 || NULL == (buf = malloc(k))) _exit(EXIT_FAILURE);
+	if (readall(c, buf, k) < 0 || buf[k-1] != 0) _exit(EXIT_FAILURE);
+	end = buf + k;
+	ac = atoi(buf);
+	if (ac < 1 || NULL == (av = malloc((ac+1) * sizeof(char *))))
+		_exit(EXIT_FAILURE);
+	p = buf + strlen(buf) + 1;
+	for (i=0; i<ac; i++) {
+		if (p >= end) _exit(EXIT_FAILURE);
+		av[i] = p;
+		p += strlen(p) + 1;
+	}
+	av[ac] = NULL;
+	if (p >= end) _exit(EXIT_FAILURE);
+	cwd = p;
+	p += strlen(p) + 1;
+	for (i=0, buf = p; buf < end; buf += strlen(buf) + 1)
+		i++;
+	if (NULL == (ev = malloc((i+1) * sizeof(char *))))
+		_exit(EXIT_FAILURE);
+	for (i=0; p < end; p += strlen(p) + 1)
+		ev[i++] = p;
+	ev[i] = NULL;
+	pid = fork();
+	if (0 == pid) {
+		close(c);
+		for (i=0; i<3; i++) {
+			k = fcntl(fds[i], F_DUPFD, 3);
+			close(fds[i]);
+			fds[i] = k;
+		}
+		for (i=0; i<3; i++) {
+			dup2(fds[i], i);
+			close(fds[i]);
+		}
+		environ = ev;
+		signal(SIGPIPE, SIG_DFL);
+		if (chdir(cwd) < 0) fatal("cannot change directory");
+		if (isatty(1))
+			Port_flags[1] |= PLINE_TAG;
+		else
+			Port_flags[1] &= ~PLINE_TAG;
+		Quiet = 0;
+		ls9main(av, 1);
+		exit(EXIT_SUCCESS);
+	}
+	for (i=0; i<3; i++)
+		close(fds[i]);
+	st = EXIT_FAILURE;
+	if (pid > 0) {
+		pfd.fd = c;
+		pfd.events = POLLIN;
+		while ((k = waitpid(pid, &st, WNOHANG)) != pid) {
+			if (k < 0 && errno != EINTR) {
+				st = EXIT_FAILURE << 8;
+				break;
+			}
+			if (poll(&pfd, 1, 100) < 1) continue;
+			if (read(c, b, 1) < 1)
+				pfd.fd = -1;
+			else if (ZYGINTR == b[0])
+				kill(pid, SIGINT);
+		}
+		st = WIFEXITED(st)? WEXITSTATUS(st):
+			WIFSIGNALED(st)? 128 + WTERMSIG(st): EXIT_FAILURE;
+	}
+	sprintf(b, "%d\n", st);
+	writeall(c, (byte *) b, strlen(b));
+	_exit(EXIT_SUCCESS);
+}
+
+void serve(char *path) {
+	char	tmp[TOKLEN+1];
+	int	s, c;
+	mode_t	m;
+
+	/* bind to a temporary name, so path appears only once listening */
+	if (strlen(path) + 5 > TOKLEN) fatal("-S: path too long");
+	sprintf(tmp, "%s.new", path);
+	unlink(tmp);
+	m = umask(077);
+	s = mksocket("-S", S_unix, mkstr(tmp, strlen(tmp)), 1);
+	umask(m);
+	if (s < 0 || rename(tmp, path) < 0)
+		fatal("cannot create server socket");
+	flush_ports();
+	signal(SIGCHLD, SIG_IGN);
+	for (;;) {
+		c = accept(s, NULL, NULL);
+		if (c < 0) continue;
+		if (0 == fork()) {
+			close(s);
+			zygote(c);
+		}
+		close(c);
 	}
-	if (existsp(imgfile) != NIL) {
-		s = loadimg(imgfile);
-		if (s != NULL) fatal(s);
-		bindset(S_imagefile,
-			mkstr(imgfile, strlen(imgfile)));
+}
+
+volatile sig_atomic_t	Zintr = 0;
+
+void zintr(int sig) {
+	Zintr = 1;
+}
+
+int zclient(char *path, char **argv) {
+	struct sigaction	sa;
+	struct sockaddr_un	su;
+	struct msghdr		m;
+	struct iovec		io;
+	struct cmsghdr		*cm;
+	union {
+		struct cmsghdr	h;
+		char		b[CMSG_SPACE(3 * sizeof(int))];
+	}			cb;
+	char			hdr[ZYGHDR+1], cwd[4096], b[20], *buf;
+	int			s, i, k, n, fds[3];
+
+	if (NULL == getcwd(cwd, sizeof(cwd))) {
+		perror("ls9: getcwd");
+		return EXIT_FAILURE;
 	}
-	else if (usrimg && strcmp(imgfile, "-") != 0) {
-		fatal("cannot open image file");
+	for (n=0; argv[n] != NULL; n++)
+		;
+	sprintf(b, "%d", n);
+	k = strlen(b) + strlen(cwd) + 2;
+	for (i=0; argv[i] != NULL; i++)
+		k += strlen(argv[i]) + 1;
+	for (i=0; environ[i] != NULL; i++)
+		k += strlen(environ[i]) + 1;
+	if (NULL == (buf = malloc(k))) {
+		fprintf(stderr, "ls9: out of memory\n");
+		return EXIT_FAILURE;
+	}
+	strcpy(buf, b);
+	n = strlen(b) + 1;
+	for (i=0; argv[i] != NULL; i++) {
+		strcpy(&buf[n], argv[i]);
+		n += strlen(argv[i]) + 1;
+	}
+	strcpy(&buf[n], cwd);
+	n += strlen(cwd) + 1;
+	for (i=0; environ[i] != NULL; i++) {
+		strcpy(&buf[n], environ[i]);
+		n += strlen(environ[i]) + 1;
+	}
+	sprintf(hdr, "%s%08x", ZYGMAGIC, (unsigned) k);
+	signal(SIGPIPE, SIG_IGN);
+	if (	strlen(path) >= sizeof(su.sun_path) ||
+		(s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+	) {
+		fprintf(stderr, "ls9: cannot create socket\n");
+		return EXIT_FAILURE;
+	}
+	memset(&su, 0, sizeof(su));
+	su.sun_family = AF_UNIX;
+	strcpy(su.sun_path, path);
+	if (connect(s, (struct sockaddr *) &su, sizeof(su)) < 0) {
+		perror("ls9: connect");
+		return EXIT_FAILURE;
+	}
+	memset(&m, 0, sizeof(m));
+	io.iov_base = hdr;
+	io.iov_len = ZYGHDR;
+	m.msg_iov = &io;
+	m.msg_iovlen = 1;
+	m.msg_control = cb.b;
+	m.msg_controllen = sizeof(cb.b);
+	cm = CMSG_FIRSTHDR(&m);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(3 * sizeof(int));
+	for (i=0; i<3; i++)
+		fds[i] = i;
+	memcpy(CMSG_DATA(cm), fds, 3 * sizeof(int));
+	if (	sendmsg(s, &m, 0) != ZYGHDR ||
+		writeall(s, (byte *) buf, k) < 0
+	) {
+		fprintf(stderr, "ls9: cannot send request\n");
+		return EXIT_FAILURE;
+	}
+	/* no SA_RESTART, so SIGINT interrupts the read below */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = zintr;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	for (n=0; n < sizeof(b)-1; n += k) {
+		k = read(s, &b[n], sizeof(b)-1-n);
+		if (k < 0 && EINTR == errno) {
+			if (Zintr) {
+				Zintr = 0;
+				b[n] = ZYGINTR;
+				writeall(s, (byte *) &b[n], 1);
+			}
+			k = 0;
+		}
+		else if (k <= 0) break;
 	}
-	else {
-		if (setjmp(Restart) != 0)
-			fatal("could not load library");
-		loadfile(IMAGESRC);
+	b[n] = 0;
+	if (0 == n) {
+		fprintf(stderr, "ls9: no response from server\n");
+		return EXIT_FAILURE;
 	}
+	return atoi(b);
+}
+
+/*
+ * Process the options in ARGV, starting at ARGV[I], and run the
+ * given program or the REPL.
+ */
+
+void ls9main(char **argv, int i) {
+	int	j, k, doload;
+
+	doload = 1;
 	if (setjmp(Restart) != 0) exit(EXIT_FAILURE);
-	for (; i<argc; i++) {
+	for (; argv[i] != NULL; i++) {
 		if (argv[i][0] != '-') break;
 		if ('-' == argv[i][1]) {
 			doload = 0;
@@ -5969,6 +11217,10 @@ int main(int argc, char **argv) {
 			case 'q':
 				Quiet = 1;
 				break;
+			case 'S':
+				i++;
+				serve(cmdarg(argv[i]));
+				break;
 			default:
 				usage();
 				exit(EXIT_FAILURE);
@@ -5987,5 +11239,62 @@ int main(int argc, char **argv) {
 		exit(EXIT_SUCCESS);
 	}
 	repl();
+}
+
+int main(int argc, char **argv) {
+	int	i, usrimg;
+	char	*s;
+	char	*imgfile;
+	cell	n;
+
+	if (argc > 2 && strcmp(argv[1], "-C") == 0) {
+		s = argv[2];
+		argv[2] = argv[0];
+		return zclient(s, &argv[2]);
+	}
+	imgfile = IMAGEFILE;
+	usrimg = 0;
+	Argv0 = argv[0];
+	if (setjmp(Restart) != 0) exit(EXIT_FAILURE);
+	init();
+	i = 1;
+	if (loadexec()) {
+		initsyms();
+		initrts();
+		n = assq(S_start, Glob);
+		if (n != NIL && closurep(cadr(n))) {
+			Quiet = 1;
+			bindset(S_quiet, TRUE);
+			Argv = argvec(&argv[1]);
+			n = cons(cadr(n), NIL);
+			eval(n, 0);
+			exit(EXIT_SUCCESS);
+		}
+	}
+	else {
+		if (argc > 2 && strcmp(argv[1], "-i") == 0) {
+			imgfile = argv[2];
+			i = 3;
+			usrimg = 1;
+		}
+		if (existsp(imgfile) != NIL) {
+			s = loadimg(imgfile);
+			if (s != NULL) fatal(s);
+			initsyms();
+			initrts();
+			bindset(S_imagefile,
+				mkstr(imgfile, strlen(imgfile)));
+		}
+		else if (usrimg && strcmp(imgfile, "-") != 0) {
+			fatal("cannot open image file");
+		}
+		else {
+			if (setjmp(Restart) != 0)
+				fatal("could not load library");
+			loadfile(IMAGESRC);
+		}
+	}
+	bindset(S_program, progpath());
+	ls9main(argv, i);
 	return 0;
 }